@@ -4,307 +4,4823 @@
 #include <ctime>
 #include <iomanip>
 #include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <cassert>
+#include <charconv>
+#include <array>
+#include <thread>
+#include <shared_mutex>
+#include <condition_variable>
+#include <future>
+#include <queue>
+#include <set>
+#include <cstddef>
+
+#ifdef _WIN32
+#define _CRT_RAND_S // rand_s, the system's secure random numbers
+#include <stdlib.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BROKESTORE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+// An amount of money in centavos. Arithmetic is exact integer arithmetic, so totals never
+// drift, and amounts are printed as pesos with two decimals.
+class Money {
+private:
+    int64_t amount = 0;
+
+    constexpr explicit Money(int64_t centavos) : amount(centavos) {}
+
+public:
+    static constexpr size_t MAX_TEXT = 24; // longest formatted amount, sign included
+
+    constexpr Money() {}
+
+    static constexpr Money fromCentavos(int64_t centavos) {
+        return Money(centavos);
+    }
+
+    constexpr int64_t centavos() const { return amount; }
+
+    // Parse "50", "49.99" or "-3.5"; more than two decimals are only accepted if they are zeros
+    static bool parse(string_view text, Money* money) {
+        bool negative = !text.empty() && text[0] == '-';
+        if (negative) text.remove_prefix(1);
+        int64_t pesos = 0;
+        if (text.empty() || text[0] != '.' || text.size() == 1) { // ".5" has no whole pesos
+            auto parsed = from_chars(text.data(), text.data() + text.size(), pesos);
+            if (parsed.ec != errc() || pesos < 0 || pesos > INT64_MAX / 100 - 1) return false;
+            text.remove_prefix(parsed.ptr - text.data());
+        }
+        int64_t fraction = 0;
+        if (!text.empty() && text[0] == '.') {
+            for (size_t i = 1; i < text.size(); ++i) {
+                if (text[i] < '0' || text[i] > '9') return false;
+                if (i <= 2) {
+                    fraction += (text[i] - '0') * (i == 1 ? 10 : 1);
+                } else if (text[i] != '0') {
+                    return false;
+                }
+            }
+        } else if (!text.empty()) {
+            return false;
+        }
+        *money = Money(negative ? -(pesos * 100 + fraction) : pesos * 100 + fraction);
+        return true;
+    }
+
+    // Write the amount as pesos ("1234.50") with to_chars; needs MAX_TEXT bytes
+    char* format(char* first, char* last) const {
+        uint64_t magnitude = amount < 0 ? 0 - uint64_t(amount) : uint64_t(amount);
+        if (amount < 0) *first++ = '-';
+        first = to_chars(first, last, magnitude / 100).ptr;
+        *first++ = '.';
+        *first++ = char('0' + magnitude % 100 / 10);
+        *first++ = char('0' + magnitude % 10);
+        return first;
+    }
+
+    string toString() const {
+        char text[MAX_TEXT];
+        return string(text, format(text, text + sizeof(text)));
+    }
+
+    constexpr Money operator+(Money other) const { return Money(amount + other.amount); }
+    constexpr Money operator-(Money other) const { return Money(amount - other.amount); }
+    constexpr Money operator*(int64_t quantity) const { return Money(amount * quantity); }
+    Money& operator+=(Money other) { amount += other.amount; return *this; }
+    Money& operator-=(Money other) { amount -= other.amount; return *this; }
+    constexpr bool operator==(Money other) const { return amount == other.amount; }
+    constexpr bool operator!=(Money other) const { return amount != other.amount; }
+    constexpr bool operator<(Money other) const { return amount < other.amount; }
+    constexpr bool operator<=(Money other) const { return amount <= other.amount; }
+    constexpr bool operator>(Money other) const { return amount > other.amount; }
+    constexpr bool operator>=(Money other) const { return amount >= other.amount; }
+};
+
+static_assert(sizeof(Money) == sizeof(int64_t), "Money must stay a plain int64_t so columns of it vectorize");
+
+inline ostream& operator<<(ostream& out, Money money) {
+    char text[Money::MAX_TEXT];
+    return out.write(text, money.format(text, text + sizeof(text)) - text);
+}
+
+// Total of a column of amounts. Four independent accumulators break the serial chain of adds,
+// so compilers turn the loop into packed 64-bit adds.
+inline Money sumAmounts(const Money* amounts, size_t count) {
+    int64_t sums[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        for (int lane = 0; lane < 4; ++lane) sums[lane] += amounts[i + lane].centavos();
+    }
+    for (; i < count; ++i) sums[0] += amounts[i].centavos();
+    return Money::fromCentavos(sums[0] + sums[1] + sums[2] + sums[3]);
+}
+
+// Total of unit price * quantity over two parallel columns, laid out like sumAmounts
+inline Money sumLineTotals(const Money* unitPrices, const int32_t* quantities, size_t count) {
+    int64_t sums[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        for (int lane = 0; lane < 4; ++lane) sums[lane] += unitPrices[i + lane].centavos() * quantities[i + lane];
+    }
+    for (; i < count; ++i) sums[0] += unitPrices[i].centavos() * quantities[i];
+    return Money::fromCentavos(sums[0] + sums[1] + sums[2] + sums[3]);
+}
+
 // Class representing a product in the store
 class Product {
 public:
     string id; 
     string name; 
-    double price; 
+    Money price; 
     string category;
+    bool retired = false; // no longer sold, kept so past orders can still show it
 
 // Constructor to initialize a product
-    Product(string id, string name, double price, string category)
+    Product(string id, string name, Money price, string category)
         : id(id), name(name), price(price), category(category) {}
 };
 
-// Struct representing an item that has been purchased
-struct PurchasedItem {
-    Product product;
-    int quantity;
-    double priceAtPurchase;
+// Binary catalog file layout (one column per field):
+// [CatalogFileHeader][ids][prices][name starts][category IDs][category starts][retired][string pool]
+// Product names, then category names, are stored back to back in the string pool; the
+// "starts" columns hold one offset per entry plus an end marker. Columns are 8-byte aligned
+// so they can be used straight from the mapped file.
+// Version 3 added the retired column; version 2 files (all products active) are still read.
+const char CATALOG_MAGIC[8] = {'N', 'B', 'C', 'A', 'T', 'L', 'G', '\0'};
+const uint32_t CATALOG_VERSION = 3;
+const uint32_t CATALOG_OLDEST_VERSION = 2;
+const size_t CATALOG_V2_HEADER_SIZE = 80;
+const size_t CATALOG_ID_LENGTH = 8;
+
+struct CatalogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t productCount;
+    uint32_t categoryCount;
+    uint32_t retiredCount;         // unused (zero) in version 2
+    uint64_t idsOffset;            // uint64_t zero-padded product ID per product
+    uint64_t pricesOffset;         // int64_t price in centavos per product
+    uint64_t nameStartsOffset;     // uint32_t per product, plus end marker
+    uint64_t categoryIdsOffset;    // uint16_t per product
+    uint64_t categoryStartsOffset; // uint32_t per category, plus end marker
+    uint64_t stringPoolOffset;
+    uint64_t stringPoolSize;
+    uint64_t retiredOffset;        // uint8_t per product, 1 if retired (version 3)
 };
 
-// Class representing an order made by a user
-class Order {
-public:
-    long long orderNumber;
-    time_t orderTime;
-    string buyerName;
-    string buyerPhone;
-    string paymentMethod;
-    vector<PurchasedItem> purchasedItems;
-    double totalPrice;
-    int totalQuantity;
+static_assert(sizeof(CatalogFileHeader) == 88, "catalog header layout changed");
 
-// Constructor to initialize an order
-Order(long long orderNumber,
-    time_t orderTime,
-    const string& buyerName,
-    const string& buyerPhone,
-    const string& paymentMethod,
-    const vector<PurchasedItem>& purchasedItems,
-    double totalPrice,
-    int totalQuantity)
-    : orderNumber(orderNumber),
-    orderTime(orderTime),
-    buyerName(buyerName),
-    buyerPhone(buyerPhone),
-    paymentMethod(paymentMethod),
-    purchasedItems(purchasedItems),
-    totalPrice(totalPrice),
-    totalQuantity(totalQuantity) {}
-};
+// Handle of a product: its position in the catalog. Carts, orders and result lists store
+// handles instead of Product copies and read the columns when they need a field.
+typedef uint32_t ProductHandle;
 
-// Class representing a shopping cart
-class ShoppingCart {
+// Pack a product ID (up to 8 characters) into an integer key, the same bytes as a zero-padded record ID
+inline bool packProductId(string_view id, uint64_t* key) {
+    if (id.empty() || id.length() > CATALOG_ID_LENGTH) return false;
+    *key = 0;
+    memcpy(key, id.data(), id.length());
+    return true;
+}
+
+// Open-addressing hash map from a 64-bit key to a 32-bit value (linear probing, power-of-two table)
+class FlatIndexMap {
 private:
-    vector<pair<Product, int>> items;
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    vector<uint64_t> keys;
+    vector<uint32_t> values; // EMPTY marks a free slot
+    size_t count = 0;
+    int shift = 64;
+
+    size_t slotFor(uint64_t key) const {
+        return size_t((key * 0x9E3779B97F4A7C15ull) >> shift);
+    }
 
-public: // Add an item to the cart
-    void addItem(const Product& product, int quantity) {
-        for (auto& item : items) {
-            if (item.first.id == product.id) {
-                item.second += quantity; // Updates quantity if product already exists
-                return;
+    void grow() {
+        vector<uint64_t> oldKeys;
+        vector<uint32_t> oldValues;
+        oldKeys.swap(keys);
+        oldValues.swap(values);
+        size_t capacity = oldKeys.empty() ? 16 : oldKeys.size() * 2;
+        keys.assign(capacity, 0);
+        values.assign(capacity, EMPTY);
+        shift = 64 - __builtin_ctzll(capacity);
+        count = 0;
+        for (size_t i = 0; i < oldKeys.size(); ++i) {
+            if (oldValues[i] != EMPTY) insert(oldKeys[i], oldValues[i]);
+        }
+    }
+
+public:
+    // Make room for the given number of entries without rehashing
+    void reserve(size_t entries) {
+        while (keys.size() < entries * 2) grow();
+    }
+
+    // Insert a key; returns false (keeping the old value) if it is already present
+    bool insert(uint64_t key, uint32_t value) {
+        if ((count + 1) * 2 > keys.size()) grow(); // keep the load factor at most 1/2
+        size_t mask = keys.size() - 1;
+        for (size_t slot = slotFor(key);; slot = (slot + 1) & mask) {
+            if (values[slot] == EMPTY) {
+                keys[slot] = key;
+                values[slot] = value;
+                ++count;
+                return true;
             }
-        } // Add new product to cart
-        items.push_back(make_pair(product, quantity));
+            if (keys[slot] == key) return false;
+        }
     }
 
-    // Remove an item from the cart by product ID
-    void removeItem(const string& productId) {
-        for (size_t i = 0; i < items.size(); ++i) {
-            if (items[i].first.id == productId) {
-                items.erase(items.begin() + i);
-                return;
+    bool find(uint64_t key, uint32_t* value) const {
+        if (count == 0) return false;
+        size_t mask = keys.size() - 1;
+        for (size_t slot = slotFor(key); values[slot] != EMPTY; slot = (slot + 1) & mask) {
+            if (keys[slot] == key) {
+                *value = values[slot];
+                return true;
             }
         }
+        return false;
     }
 
-    // Update the quantity of a specific item in the cart
-    void updateQuantity(const string& productId, int newQuantity) {
-        for (auto& item : items) {
-            if (item.first.id == productId) {
-                item.second = newQuantity;
-                return;
+    // Insert a key or overwrite its value
+    void set(uint64_t key, uint32_t value) {
+        if (count > 0) {
+            size_t mask = keys.size() - 1;
+            for (size_t slot = slotFor(key); values[slot] != EMPTY; slot = (slot + 1) & mask) {
+                if (keys[slot] == key) {
+                    values[slot] = value;
+                    return;
+                }
             }
         }
+        insert(key, value);
     }
 
-    // View the contents of the cart
-    void viewCart() const {
-        if (items.empty()) {
-            cout << "\nYour cart is empty." << endl;
-            return;
+    // Remove a key; later entries of its probe run are shifted back so no tombstones are left
+    bool erase(uint64_t key) {
+        if (count == 0) return false;
+        size_t mask = keys.size() - 1;
+        size_t hole = slotFor(key);
+        while (values[hole] == EMPTY || keys[hole] != key) {
+            if (values[hole] == EMPTY) return false;
+            hole = (hole + 1) & mask;
         }
-        double total = 0;
-        cout << "\nItems in your cart:\n" << string(30, '-') << endl;
-        for (int i = items.size() - 1; i >= 0; --i) {
-            cout << items[i].first.id << " - " << items[i].first.name
-                 << " - Quantity: " << items[i].second
-                 << " - Item Price: Php. " << fixed << setprecision(2) << items[i].first.price
-                 << " - Subtotal: Php. " << fixed << setprecision(2) << items[i].first.price * items[i].second << endl;
-            total += items[i].first.price * items[i].second;
+        for (size_t slot = (hole + 1) & mask; values[slot] != EMPTY; slot = (slot + 1) & mask) {
+            size_t home = slotFor(keys[slot]);
+            if (((slot - home) & mask) >= ((slot - hole) & mask)) { // the hole is on its probe path
+                keys[hole] = keys[slot];
+                values[hole] = values[slot];
+                hole = slot;
+            }
         }
-        cout << string(30, '-') << endl;
-        cout << "Total items in cart: " << totalItems() << endl;
-        cout << "Total Price: Php. " << fixed << setprecision(2) << total << endl;
+        values[hole] = EMPTY;
+        --count;
+        return true;
     }
 
-    // Get the total number of items in the cart
-    int totalItems() const {
-        int totalQuantity = 0;
-        for (const auto& item : items) {
-            totalQuantity += item.second;
+    void clear() {
+        fill(values.begin(), values.end(), EMPTY);
+        count = 0;
+    }
+
+    size_t size() const { return count; }
+};
+
+// Collision-free hash of a fixed set of packed product IDs: slot = (key * multiplier) >> shift,
+// each slot holding a product handle or -1. Generated at compile time for the built-in catalog.
+struct PerfectHashTable {
+    uint64_t multiplier;
+    int shift;
+    const int16_t* slots;
+
+    bool find(uint64_t key, uint32_t* handle) const {
+        int16_t slot = slots[(key * multiplier) >> shift];
+        if (slot < 0) return false;
+        *handle = uint32_t(slot);
+        return true;
+    }
+};
+
+// Read-only view of a whole file, memory-mapped so that pages are shared between processes
+class MappedFile {
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    vector<char> buffer; // no mmap here, fall back to reading the file
+#endif
+
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    // Map the file at the given path
+    bool open(const string& path, string* errorMessage) {
+        close();
+#ifdef _WIN32
+        ifstream in(path, ios::binary);
+        if (!in) {
+            *errorMessage = "Cannot open " + path + ".";
+            return false;
+        }
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+        return true;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            *errorMessage = "Cannot open " + path + ".";
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            *errorMessage = "Cannot read " + path + ".";
+            return false;
+        }
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // the mapping stays valid after closing the descriptor
+        if (mapped == MAP_FAILED) {
+            *errorMessage = "Cannot map " + path + ".";
+            return false;
         }
-        return totalQuantity;
+        data = static_cast<const char*>(mapped);
+        length = info.st_size;
+        return true;
+#endif
     }
 
-    // Get the items in the cart
-    vector<pair<Product, int>> getItems() const {
-        return items;
+    // Unmap the file
+    void close() {
+#ifdef _WIN32
+        buffer.clear();
+#else
+        if (data) munmap(const_cast<char*>(data), length);
+#endif
+        data = nullptr;
+        length = 0;
     }
 
-    // Clear the cart
-    void clearCart() {
-        items.clear();
+    const char* bytes() const { return data; }
+    size_t size() const { return length; }
+};
+
+// Write a file so that it is either fully replaced or left alone: write a temporary file,
+// flush it to disk, then rename it over the old one
+bool replaceFileDurably(const string& path, string_view data, string* errorMessage) {
+    string temporary = path + ".tmp";
+#ifdef _WIN32
+    int fd = _open(temporary.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) {
+        *errorMessage = "Cannot create " + temporary + ".";
+        return false;
+    }
+    size_t written = 0;
+    bool ok = true;
+    while (ok && written < data.size()) {
+#ifdef _WIN32
+        int result = _write(fd, data.data() + written, unsigned(min<size_t>(data.size() - written, INT32_MAX)));
+#else
+        ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+#endif
+        ok = result > 0;
+        if (ok) written += result;
+    }
+#ifdef _WIN32
+    ok = ok && _commit(fd) == 0;
+    _close(fd);
+    if (ok) remove(path.c_str()); // rename does not replace an existing file here
+#else
+    ok = ok && fsync(fd) == 0;
+    ::close(fd);
+#endif
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        *errorMessage = "Cannot write " + path + ".";
+        return false;
     }
+    return true;
+}
 
-    // Check if the cart is empty
-    bool isEmpty() const {
-        return items.empty();
+// Product catalog stored as columns (IDs, prices, names, categories), backed by the binary
+// catalog format either mapped from disk or built in memory
+class Catalog {
+private:
+    MappedFile file;          // backing storage when loaded from a file
+    vector<char> ownedData;   // backing storage when built from a product list
+    const uint64_t* ids = nullptr;
+    const int64_t* prices = nullptr;
+    const uint32_t* nameStarts = nullptr;
+    const uint16_t* categoryIds = nullptr;
+    const uint32_t* categoryStarts = nullptr;
+    const uint8_t* retiredFlags = nullptr; // null when no product is retired
+    const char* stringPool = nullptr;
+    uint64_t stringPoolSize = 0;
+    uint32_t count = 0;
+    uint32_t categories = 0;
+    uint32_t retired = 0;
+    const PerfectHashTable* idHash = nullptr; // compile-time ID lookup, built-in catalog only
+
+    // Check that a column of `entries` items of type T fits in the image and is aligned
+    template <typename T>
+    static bool columnFits(uint64_t offset, uint64_t entries, size_t length) {
+        return offset % alignof(T) == 0 && offset <= length && entries <= (length - offset) / sizeof(T);
     }
-    
-    // Set new items for the cart
-    void setItems(const vector<pair<Product, int>>& newItems) {
-        items = newItems;
+
+    // Point the catalog at a serialized image after checking its header
+    bool attach(const char* data, size_t length, string* errorMessage) {
+        if (length < CATALOG_V2_HEADER_SIZE) {
+            *errorMessage = "Catalog file is too small.";
+            return false;
+        }
+        CatalogFileHeader header = {};
+        memcpy(&header, data, CATALOG_V2_HEADER_SIZE);
+        if (memcmp(header.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0) {
+            *errorMessage = "Not a catalog file.";
+            return false;
+        }
+        if (header.version < CATALOG_OLDEST_VERSION || header.version > CATALOG_VERSION) {
+            *errorMessage = "Unsupported catalog version " + to_string(header.version) +
+                            ", convert the CSV again with --convert-catalog.";
+            return false;
+        }
+        if (header.version >= 3) {
+            if (length < sizeof(CatalogFileHeader)) {
+                *errorMessage = "Catalog file is too small.";
+                return false;
+            }
+            memcpy(&header, data, sizeof(header));
+        } else {
+            header.retiredCount = 0;
+        }
+        if (header.retiredCount > 0 && !columnFits<uint8_t>(header.retiredOffset, header.productCount, length)) {
+            *errorMessage = "Catalog file is truncated.";
+            return false;
+        }
+        if (!columnFits<uint64_t>(header.idsOffset, header.productCount, length) ||
+            !columnFits<int64_t>(header.pricesOffset, header.productCount, length) ||
+            !columnFits<uint32_t>(header.nameStartsOffset, header.productCount + 1ull, length) ||
+            !columnFits<uint16_t>(header.categoryIdsOffset, header.productCount, length) ||
+            !columnFits<uint32_t>(header.categoryStartsOffset, header.categoryCount + 1ull, length) ||
+            !columnFits<char>(header.stringPoolOffset, header.stringPoolSize, length)) {
+            *errorMessage = "Catalog file is truncated.";
+            return false;
+        }
+        // Category IDs index the category table and per-category sums, so each must name one
+        const uint16_t* categoryColumn = reinterpret_cast<const uint16_t*>(data + header.categoryIdsOffset);
+        for (uint32_t i = 0; i < header.productCount; ++i) {
+            if (categoryColumn[i] >= header.categoryCount) {
+                *errorMessage = "Catalog file has a product in an unknown category.";
+                return false;
+            }
+        }
+        ids = reinterpret_cast<const uint64_t*>(data + header.idsOffset);
+        prices = reinterpret_cast<const int64_t*>(data + header.pricesOffset);
+        nameStarts = reinterpret_cast<const uint32_t*>(data + header.nameStartsOffset);
+        categoryIds = categoryColumn;
+        categoryStarts = reinterpret_cast<const uint32_t*>(data + header.categoryStartsOffset);
+        retiredFlags = header.retiredCount > 0 ? reinterpret_cast<const uint8_t*>(data + header.retiredOffset) : nullptr;
+        stringPool = data + header.stringPoolOffset;
+        stringPoolSize = header.stringPoolSize;
+        count = header.productCount;
+        categories = header.categoryCount;
+        retired = header.retiredCount;
+        return true;
+    }
+
+    // Slice of the string pool between two offsets, empty if the file is corrupt
+    string_view poolString(uint32_t start, uint32_t end) const {
+        if (start > end || end > stringPoolSize) return string_view();
+        return string_view(stringPool + start, end - start);
+    }
+
+    // Append a column to the image at the next 8-byte boundary and return its offset
+    template <typename T>
+    static uint64_t appendColumn(vector<char>* image, const vector<T>& column) {
+        image->resize((image->size() + 7) & ~size_t(7));
+        uint64_t offset = image->size();
+        image->resize(offset + column.size() * sizeof(T));
+        if (!column.empty()) memcpy(image->data() + offset, column.data(), column.size() * sizeof(T));
+        return offset;
+    }
+
+public:
+    Catalog() {}
+    Catalog(const Catalog&) = delete;
+    Catalog& operator=(const Catalog&) = delete;
+
+    // Serialize a product list into the binary catalog format
+    static bool serialize(const vector<Product>& products, vector<char>* image, string* errorMessage) {
+        vector<uint64_t> idColumn;
+        vector<int64_t> priceColumn;
+        vector<uint32_t> nameStartColumn;
+        vector<uint16_t> categoryIdColumn;
+        vector<uint8_t> retiredColumn;
+        uint32_t retiredCount = 0;
+        vector<string> categoryNames;
+        unordered_map<string, uint16_t> categoryLookup;
+        string pool;
+
+        for (const auto& product : products) {
+            uint64_t key;
+            if (!packProductId(product.id, &key)) {
+                *errorMessage = "Invalid product ID '" + product.id + "'.";
+                return false;
+            }
+            if (product.price < Money()) {
+                *errorMessage = "Negative price for product " + product.id + ".";
+                return false;
+            }
+            auto category = categoryLookup.find(product.category);
+            if (category == categoryLookup.end()) {
+                if (categoryNames.size() > UINT16_MAX) {
+                    *errorMessage = "Too many categories.";
+                    return false;
+                }
+                category = categoryLookup.emplace(product.category, uint16_t(categoryNames.size())).first;
+                categoryNames.push_back(product.category);
+            }
+            idColumn.push_back(key);
+            priceColumn.push_back(product.price.centavos());
+            nameStartColumn.push_back(pool.size());
+            categoryIdColumn.push_back(category->second);
+            retiredColumn.push_back(product.retired ? 1 : 0);
+            retiredCount += product.retired ? 1 : 0;
+            pool += product.name;
+        }
+        nameStartColumn.push_back(pool.size());
+
+        vector<uint32_t> categoryStartColumn;
+        for (const string& name : categoryNames) {
+            categoryStartColumn.push_back(pool.size());
+            pool += name;
+        }
+        categoryStartColumn.push_back(pool.size());
+        if (pool.size() > UINT32_MAX) {
+            *errorMessage = "Product names are too large for one catalog.";
+            return false;
+        }
+
+        CatalogFileHeader header = {};
+        memcpy(header.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+        header.version = CATALOG_VERSION;
+        header.productCount = idColumn.size();
+        header.categoryCount = categoryNames.size();
+        header.retiredCount = retiredCount;
+
+        image->assign(sizeof(CatalogFileHeader), 0);
+        header.idsOffset = appendColumn(image, idColumn);
+        header.pricesOffset = appendColumn(image, priceColumn);
+        header.nameStartsOffset = appendColumn(image, nameStartColumn);
+        header.categoryIdsOffset = appendColumn(image, categoryIdColumn);
+        header.categoryStartsOffset = appendColumn(image, categoryStartColumn);
+        if (retiredCount > 0) header.retiredOffset = appendColumn(image, retiredColumn);
+        header.stringPoolOffset = image->size();
+        header.stringPoolSize = pool.size();
+        image->insert(image->end(), pool.begin(), pool.end());
+        memcpy(image->data(), &header, sizeof(header));
+        return true;
+    }
+
+    // Map a catalog file; the cost does not depend on the number of products
+    bool loadFromFile(const string& path, string* errorMessage) {
+        if (!file.open(path, errorMessage)) return false;
+        if (!attach(file.bytes(), file.size(), errorMessage)) {
+            file.close();
+            return false;
+        }
+        ownedData.clear();
+        idHash = nullptr;
+        return true;
+    }
+
+    // Build the catalog in memory from a product list
+    bool loadProducts(const vector<Product>& products, string* errorMessage) {
+        vector<char> image;
+        if (!serialize(products, &image, errorMessage)) return false;
+        return loadImage(move(image), errorMessage);
+    }
+
+    // Take over an image made by serialize
+    bool loadImage(vector<char> image, string* errorMessage) {
+        file.close();
+        ownedData.swap(image);
+        idHash = nullptr;
+        return attach(ownedData.data(), ownedData.size(), errorMessage);
+    }
+
+    // Use a catalog image that is compiled into the program, with its ID hash; nothing is copied
+    bool loadStatic(const char* image, size_t length, const PerfectHashTable* hash, string* errorMessage) {
+        file.close();
+        ownedData.clear();
+        idHash = hash;
+        return attach(image, length, errorMessage);
+    }
+
+    // Compile-time ID hash for this catalog, or null
+    const PerfectHashTable* perfectIdHash() const {
+        return idHash;
+    }
+
+    uint32_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    uint32_t categoryCount() const { return categories; }
+    uint32_t activeCount() const { return count - retired; }
+
+    bool isRetired(ProductHandle product) const {
+        return retiredFlags && retiredFlags[product];
+    }
+
+    string_view id(ProductHandle product) const {
+        const char* id = reinterpret_cast<const char*>(&ids[product]);
+        return string_view(id, strnlen(id, CATALOG_ID_LENGTH));
+    }
+
+    uint64_t packedId(ProductHandle product) const {
+        return ids[product];
+    }
+
+    string_view name(ProductHandle product) const {
+        return poolString(nameStarts[product], nameStarts[product + 1]);
+    }
+
+    uint16_t categoryId(ProductHandle product) const {
+        return categoryIds[product];
+    }
+
+    string_view categoryName(uint16_t category) const {
+        if (category >= categories) return string_view();
+        return poolString(categoryStarts[category], categoryStarts[category + 1]);
+    }
+
+    string_view category(ProductHandle product) const {
+        return categoryName(categoryIds[product]);
+    }
+
+    int64_t priceCentavos(ProductHandle product) const {
+        return prices[product];
+    }
+
+    Money price(ProductHandle product) const {
+        return Money::fromCentavos(prices[product]);
+    }
+
+    // Copy every product out as rows, in handle order (used to build an updated catalog)
+    vector<Product> toProducts() const {
+        vector<Product> products;
+        products.reserve(count);
+        for (ProductHandle i = 0; i < count; ++i) {
+            products.emplace_back(string(id(i)), string(name(i)), price(i), string(category(i)));
+            products.back().retired = isRetired(i);
+        }
+        return products;
     }
 };
 
-// Class representing a user
-class User {
+// Product ID -> handle lookup for products on sale, built once on first use.
+// IDs are packed into 64-bit keys so a lookup is one hash and usually one probe.
+class ProductIdIndex {
+private:
+    const Catalog& catalog;
+    once_flag built;
+    FlatIndexMap map;
+
+    void build() {
+        map.reserve(catalog.activeCount());
+        for (uint32_t i = 0; i < catalog.size(); ++i) {
+            if (catalog.isRetired(i)) continue;
+            map.insert(catalog.packedId(i), i); // the first product wins if an ID repeats
+        }
+    }
+
 public:
-    string email;
-    string password;
-    vector<Order> purchaseHistory;
-    ShoppingCart userCart;
+    ProductIdIndex(const Catalog& catalog) : catalog(catalog) {}
+
+    // Find the handle of a product ID
+    bool find(string_view id, ProductHandle* index) {
+        uint64_t key;
+        if (!packProductId(id, &key)) return false;
+        if (const PerfectHashTable* hash = catalog.perfectIdHash()) { // built-in catalog, nothing to build
+            return hash->find(key, index) && catalog.packedId(*index) == key && !catalog.isRetired(*index);
+        }
+        call_once(built, [this] { build(); });
+        return map.find(key, index);
+    }
+};
 
-    // Constructor to initialize a user
-    User(string email = "", string password = "") : email(email), password(password) {}
+// Non-owning view of a list of product handles (search results, a category, ...)
+class ProductIndexSpan {
+private:
+    const ProductHandle* first = nullptr;
+    size_t count = 0;
 
-    // Add an order to the user's purchase history
-    void addOrder(const Order& order) {
-        purchaseHistory.push_back(order);
+public:
+    ProductIndexSpan() {}
+    ProductIndexSpan(const ProductHandle* first, size_t count) : first(first), count(count) {}
+    ProductIndexSpan(const vector<ProductHandle>& handles) : first(handles.data()), count(handles.size()) {}
+
+    const ProductHandle* begin() const { return first; }
+    const ProductHandle* end() const { return first + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    ProductHandle operator[](size_t i) const { return first[i]; }
+};
+
+// Products of each category, precomputed. Categories are already interned to small integer
+// IDs in the catalog file; this adds the per-category lists of products on sale, built once on first use.
+class CategoryIndex {
+private:
+    const Catalog& catalog;
+    once_flag built;
+    vector<string_view> names;          // category name by ID
+    vector<uint32_t> memberStarts;      // start of each category's product list, plus one end marker
+    vector<ProductHandle> members;      // products grouped by category, catalog order within a group
+
+    void build() {
+        uint32_t categoryCount = catalog.categoryCount();
+        for (uint16_t c = 0; c < categoryCount; ++c) names.push_back(catalog.categoryName(c));
+
+        // Counting sort of the products by category
+        memberStarts.assign(categoryCount + 1, 0);
+        for (ProductHandle i = 0; i < catalog.size(); ++i) {
+            if (catalog.categoryId(i) < categoryCount && !catalog.isRetired(i)) ++memberStarts[catalog.categoryId(i) + 1];
+        }
+        for (uint32_t c = 0; c < categoryCount; ++c) memberStarts[c + 1] += memberStarts[c];
+        vector<uint32_t> next(memberStarts.begin(), memberStarts.end() - 1);
+        members.resize(memberStarts[categoryCount]);
+        for (ProductHandle i = 0; i < catalog.size(); ++i) {
+            if (catalog.categoryId(i) < categoryCount && !catalog.isRetired(i)) members[next[catalog.categoryId(i)]++] = i;
+        }
+    }
+
+public:
+    CategoryIndex(const Catalog& catalog) : catalog(catalog) {}
+
+    // Names of all categories, indexed by category ID
+    const vector<string_view>& categories() {
+        call_once(built, [this] { build(); });
+        return names;
+    }
+
+    // All products in a category, without copying
+    ProductIndexSpan productsIn(uint16_t categoryId) {
+        call_once(built, [this] { build(); });
+        return ProductIndexSpan(members.data() + memberStarts[categoryId],
+                                memberStarts[categoryId + 1] - memberStarts[categoryId]);
     }
 };
 
-// Class for user authentication
-class Auth {
+// Number of products in one price bucket of a range query
+struct PriceBucket {
+    int64_t fromCentavos; // inclusive
+    int64_t toCentavos;   // exclusive, INT64_MAX for the open-ended last bucket
+    size_t count;
+};
+
+// Products on sale sorted by price (ties by handle), built once on first use.
+// A price range is a contiguous slice found by binary search, and the bucket counts are
+// found the same way, so a query costs O(log N) plus the size of the slice that is shown.
+class PriceIndex {
 private:
-    vector<User> users;
+    const Catalog& catalog;
+    once_flag built;
+    vector<ProductHandle> byPrice;
+
+    void build() {
+        byPrice.reserve(catalog.activeCount());
+        for (ProductHandle i = 0; i < catalog.size(); ++i) {
+            if (!catalog.isRetired(i)) byPrice.push_back(i);
+        }
+        sort(byPrice.begin(), byPrice.end(), [this](ProductHandle a, ProductHandle b) {
+            return catalog.priceCentavos(a) != catalog.priceCentavos(b) ? catalog.priceCentavos(a) < catalog.priceCentavos(b) : a < b;
+        });
+    }
+
+    // First position whose price is at least the given amount
+    const ProductHandle* firstAtLeast(int64_t centavos) const {
+        return partition_point(byPrice.data(), byPrice.data() + byPrice.size(),
+                               [&](ProductHandle h) { return catalog.priceCentavos(h) < centavos; });
+    }
 
 public:
-    // Constructor to initialize with a default user
-    Auth() {
-        users.emplace_back("alex_trisha@gmail.com", "inteprogfinals");
+    PriceIndex(const Catalog& catalog) : catalog(catalog) {}
+
+    // Products priced from minCentavos to maxCentavos (both inclusive), cheapest first.
+    // `bucketBounds` are ascending bucket start prices; each bucket's count within the range is
+    // written to `facets`.
+    ProductIndexSpan range(int64_t minCentavos, int64_t maxCentavos, const vector<int64_t>& bucketBounds,
+                           vector<PriceBucket>* facets) {
+        call_once(built, [this] { build(); });
+        const ProductHandle* begin = firstAtLeast(minCentavos);
+        const ProductHandle* end = maxCentavos == INT64_MAX ? byPrice.data() + byPrice.size() : firstAtLeast(maxCentavos + 1);
+        if (end < begin) end = begin;
+
+        facets->clear();
+        for (size_t b = 0; b < bucketBounds.size(); ++b) {
+            int64_t from = bucketBounds[b];
+            int64_t to = b + 1 < bucketBounds.size() ? bucketBounds[b + 1] : INT64_MAX;
+            const ProductHandle* bucketBegin = max(begin, firstAtLeast(from));
+            const ProductHandle* bucketEnd = to == INT64_MAX ? end : min(end, firstAtLeast(to));
+            size_t count = bucketEnd > bucketBegin ? bucketEnd - bucketBegin : 0;
+            if (count > 0) facets->push_back({from, to, count});
+        }
+        return ProductIndexSpan(begin, end - begin);
     }
+};
 
-      bool signUp(const string& email, const string& password, string* errorMessage) {
-        bool hasGmail = false;
-        for (size_t i = 0; i + 9 <= email.length(); ++i) {
-            if (email.substr(i, 10) == "@gmail.com") {
-                hasGmail = true; // Checks for valid Gmail format
-                break;
+// Split one CSV line into fields, honoring double-quoted fields
+vector<string> parseCsvLine(const string& line) {
+    vector<string> fields;
+    string field;
+    bool quoted = false;
+    for (size_t i = 0; i < line.length(); ++i) {
+        char c = line[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < line.length() && line[i + 1] == '"') {
+                field += '"';
+                ++i;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                field += c;
             }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(field);
+            field.clear();
+        } else if (c != '\r') {
+            field += c;
         }
-        if (!hasGmail) {
-            *errorMessage = "Invalid email format. It must be a valid gmail.";
+    }
+    fields.push_back(field);
+    return fields;
+}
+
+// Convert a CSV file (id,name,price,category with a header row) into a binary catalog file
+bool convertCatalogCsv(const string& csvPath, const string& catalogPath, string* errorMessage) {
+    ifstream in(csvPath);
+    if (!in) {
+        *errorMessage = "Cannot open " + csvPath + ".";
+        return false;
+    }
+
+    vector<Product> products;
+    string line;
+    size_t lineNumber = 0;
+    while (getline(in, line)) {
+        ++lineNumber;
+        if (lineNumber == 1 || line.empty() || line == "\r") continue; // skip header and blank lines
+        vector<string> fields = parseCsvLine(line);
+        if (fields.size() != 4) {
+            *errorMessage = "Line " + to_string(lineNumber) + ": expected 4 fields.";
             return false;
         }
-
-        if (password.length() < 8) {
-            *errorMessage = "Password must be at least 8 characters long.";
+        Money price;
+        if (!Money::parse(fields[2], &price)) {
+            *errorMessage = "Line " + to_string(lineNumber) + ": invalid price.";
             return false;
         }
-         for (const auto& user : users) {
-            if (user.email == email) {
-                *errorMessage = "User already exists.";
-                return false; // Checks for existing user
+        products.emplace_back(fields[0], fields[1], price, fields[3]);
+    }
+
+    vector<char> image;
+    if (!Catalog::serialize(products, &image, errorMessage)) return false;
+
+    ofstream out(catalogPath, ios::binary | ios::trunc);
+    out.write(image.data(), image.size());
+    if (!out) {
+        *errorMessage = "Cannot write " + catalogPath + ".";
+        return false;
+    }
+    return true;
+}
+
+// Built-in catalog, used when no catalog file is found. The product list is checked and laid
+// out in the binary catalog format at compile time, together with a perfect hash of its IDs,
+// so starting with it costs no allocation and no parsing.
+struct SeedProduct {
+    const char* id;
+    const char* name;
+    double price;
+    const char* category;
+};
+
+constexpr SeedProduct SEED_PRODUCTS[] = {
+    {"0001", "Canva Template Pack", 50.00, "Digital Templates"},
+    {"0002", "Resume Template", 10.00, "Digital Templates"},
+    {"0003", "Presentation Template PPT", 20.00, "Digital Templates"},
+    {"0004", "Instagram Story Templates", 8.00, "Digital Templates"},
+    {"0005", "Website Theme HTML", 120.00, "Digital Templates"},
+
+    {"1001", "Ebook: Learn Coding", 20.00, "Educational Content"},
+    {"1002", "Online Course: Design Basics", 50.00, "Educational Content"},
+    {"1003", "Study Guide - Math", 25.00, "Educational Content"},
+    {"1004", "Language Learning Pack", 22.00, "Educational Content"},
+    {"1005", "Printable Planner Set", 115.00, "Educational Content"},
+
+    {"2001", "Stock Photos Bundle", 30.00, "Creative Assets"},
+    {"2002", "Vector Graphics Pack", 28.00, "Creative Assets"},
+    {"2003", "Font Collection", 23.00, "Creative Assets"},
+    {"2004", "Icon Set", 18.00, "Creative Assets"},
+    {"2005", "Photoshop Presets", 45.00, "Creative Assets"},
+
+    {"3001", "Mobile App: Productivity", 40.00, "Software & Tools"},
+    {"3002", "WordPress Plugin Premium", 35.00, "Software & Tools"},
+    {"3003", "Website Builder Theme", 45.00, "Software & Tools"},
+    {"3004", "API Access Pack", 130.00, "Software & Tools"},
+    {"3005", "SDK for Developers", 180.00, "Software & Tools"},
+
+    {"4001", "Royalty-Free Music Pack", 30.00, "Music & Audio"},
+    {"4002", "Sound Effects Collection", 25.00, "Music & Audio"},
+    {"4003", "Audiobook: Business Success", 25.00, "Music & Audio"},
+    {"4004", "Paid Podcast Subscription", 55.00, "Music & Audio"},
+    {"4005", "Voiceover Samples", 20.00, "Music & Audio"},
+
+    {"5001", "Business Plan Template", 169.00, "Business & Marketing"},
+    {"5002", "Marketing Kit", 49.00, "Business & Marketing"},
+    {"5003", "Email Template Set", 18.00, "Business & Marketing"},
+    {"5004", "Logo Design Files", 45.00, "Business & Marketing"},
+    {"5005", "Brand Style Guide", 50.00, "Business & Marketing"},
+};
+
+constexpr size_t SEED_COUNT = sizeof(SEED_PRODUCTS) / sizeof(SEED_PRODUCTS[0]);
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The built-in catalog image is generated little-endian."
+#endif
+
+constexpr size_t constLength(const char* text) {
+    size_t length = 0;
+    while (text[length] != '\0') ++length;
+    return length;
+}
+
+constexpr bool constEqual(const char* a, const char* b) {
+    while (*a != '\0' && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return *a == *b;
+}
+
+// Same key as packProductId: the ID bytes, zero-padded, read as a little-endian integer
+constexpr uint64_t constPackId(const char* id) {
+    uint64_t key = 0;
+    for (size_t i = 0; id[i] != '\0'; ++i) key |= uint64_t(uint8_t(id[i])) << (8 * i);
+    return key;
+}
+
+constexpr int64_t constCentavos(double price) {
+    return int64_t(price * 100 + 0.5);
+}
+
+// Every product has a 1-8 character ID, a name, a category and a non-negative price
+constexpr bool seedFieldsValid() {
+    for (const SeedProduct& product : SEED_PRODUCTS) {
+        size_t idLength = constLength(product.id);
+        if (idLength == 0 || idLength > CATALOG_ID_LENGTH) return false;
+        if (constLength(product.name) == 0 || constLength(product.category) == 0) return false;
+        if (!(product.price >= 0)) return false;
+    }
+    return true;
+}
+
+constexpr bool seedIdsUnique() {
+    for (size_t i = 0; i < SEED_COUNT; ++i) {
+        for (size_t j = i + 1; j < SEED_COUNT; ++j) {
+            if (constEqual(SEED_PRODUCTS[i].id, SEED_PRODUCTS[j].id)) return false;
+        }
+    }
+    return true;
+}
+
+// The store's departments; a built-in product must belong to one of them
+constexpr const char* KNOWN_CATEGORIES[] = {"Digital Templates", "Educational Content", "Creative Assets",
+                                            "Software & Tools", "Music & Audio", "Business & Marketing"};
+
+constexpr bool seedCategoriesKnown() {
+    for (const SeedProduct& product : SEED_PRODUCTS) {
+        bool known = false;
+        for (const char* category : KNOWN_CATEGORIES) known = known || constEqual(product.category, category);
+        if (!known) return false;
+    }
+    return true;
+}
+
+static_assert(SEED_COUNT > 0 && SEED_COUNT <= INT16_MAX, "built-in catalog size out of range");
+static_assert(seedFieldsValid(), "built-in product with a bad ID, empty name or category, or negative price");
+static_assert(seedIdsUnique(), "built-in product IDs must be unique");
+static_assert(seedCategoriesKnown(), "built-in product in a category not listed in KNOWN_CATEGORIES");
+
+// Categories are numbered in order of first appearance, as Catalog::serialize does
+constexpr size_t seedFirstWithCategory(size_t product) {
+    size_t first = 0;
+    while (!constEqual(SEED_PRODUCTS[first].category, SEED_PRODUCTS[product].category)) ++first;
+    return first;
+}
+
+constexpr uint16_t seedCategoryId(size_t product) {
+    size_t first = seedFirstWithCategory(product);
+    uint16_t categoryId = 0;
+    for (size_t i = 0; i < first; ++i) {
+        if (seedFirstWithCategory(i) == i) ++categoryId;
+    }
+    return categoryId;
+}
+
+// Column offsets of the built-in catalog image, following Catalog::serialize
+struct SeedLayout {
+    uint32_t categoryCount = 0;
+    uint64_t idsOffset = 0;
+    uint64_t pricesOffset = 0;
+    uint64_t nameStartsOffset = 0;
+    uint64_t categoryIdsOffset = 0;
+    uint64_t categoryStartsOffset = 0;
+    uint64_t stringPoolOffset = 0;
+    uint64_t stringPoolSize = 0;
+};
+
+constexpr uint64_t alignColumn(uint64_t offset) {
+    return (offset + 7) & ~uint64_t(7);
+}
+
+constexpr SeedLayout seedLayout() {
+    SeedLayout layout;
+    uint64_t poolSize = 0;
+    for (size_t i = 0; i < SEED_COUNT; ++i) {
+        poolSize += constLength(SEED_PRODUCTS[i].name);
+        if (seedFirstWithCategory(i) == i) {
+            ++layout.categoryCount;
+            poolSize += constLength(SEED_PRODUCTS[i].category);
+        }
+    }
+    layout.idsOffset = sizeof(CatalogFileHeader);
+    layout.pricesOffset = alignColumn(layout.idsOffset + SEED_COUNT * sizeof(uint64_t));
+    layout.nameStartsOffset = alignColumn(layout.pricesOffset + SEED_COUNT * sizeof(int64_t));
+    layout.categoryIdsOffset = alignColumn(layout.nameStartsOffset + (SEED_COUNT + 1) * sizeof(uint32_t));
+    layout.categoryStartsOffset = alignColumn(layout.categoryIdsOffset + SEED_COUNT * sizeof(uint16_t));
+    layout.stringPoolOffset = layout.categoryStartsOffset + (layout.categoryCount + 1) * sizeof(uint32_t);
+    layout.stringPoolSize = poolSize;
+    return layout;
+}
+
+constexpr SeedLayout SEED_LAYOUT = seedLayout();
+constexpr size_t SEED_IMAGE_SIZE = SEED_LAYOUT.stringPoolOffset + SEED_LAYOUT.stringPoolSize;
+
+typedef array<char, SEED_IMAGE_SIZE> SeedImage;
+
+constexpr void putLittleEndian(SeedImage& image, uint64_t offset, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i) image[offset + i] = char(uint8_t(value >> (8 * i)));
+}
+
+constexpr SeedImage buildSeedImage() {
+    SeedImage image{};
+    const SeedLayout& layout = SEED_LAYOUT;
+    for (size_t i = 0; i < sizeof(CATALOG_MAGIC); ++i) image[i] = CATALOG_MAGIC[i];
+    putLittleEndian(image, offsetof(CatalogFileHeader, version), CATALOG_VERSION, 4);
+    putLittleEndian(image, offsetof(CatalogFileHeader, productCount), SEED_COUNT, 4);
+    putLittleEndian(image, offsetof(CatalogFileHeader, categoryCount), layout.categoryCount, 4);
+    putLittleEndian(image, offsetof(CatalogFileHeader, retiredCount), 0, 4);
+    putLittleEndian(image, offsetof(CatalogFileHeader, idsOffset), layout.idsOffset, 8);
+    putLittleEndian(image, offsetof(CatalogFileHeader, pricesOffset), layout.pricesOffset, 8);
+    putLittleEndian(image, offsetof(CatalogFileHeader, nameStartsOffset), layout.nameStartsOffset, 8);
+    putLittleEndian(image, offsetof(CatalogFileHeader, categoryIdsOffset), layout.categoryIdsOffset, 8);
+    putLittleEndian(image, offsetof(CatalogFileHeader, categoryStartsOffset), layout.categoryStartsOffset, 8);
+    putLittleEndian(image, offsetof(CatalogFileHeader, stringPoolOffset), layout.stringPoolOffset, 8);
+    putLittleEndian(image, offsetof(CatalogFileHeader, stringPoolSize), layout.stringPoolSize, 8);
+
+    uint64_t poolEnd = 0;
+    auto appendToPool = [&image, &layout, &poolEnd](const char* text) {
+        for (size_t i = 0; text[i] != '\0'; ++i) image[layout.stringPoolOffset + poolEnd++] = text[i];
+    };
+    for (size_t i = 0; i < SEED_COUNT; ++i) {
+        putLittleEndian(image, layout.idsOffset + i * 8, constPackId(SEED_PRODUCTS[i].id), 8);
+        putLittleEndian(image, layout.pricesOffset + i * 8, uint64_t(constCentavos(SEED_PRODUCTS[i].price)), 8);
+        putLittleEndian(image, layout.nameStartsOffset + i * 4, poolEnd, 4);
+        putLittleEndian(image, layout.categoryIdsOffset + i * 2, seedCategoryId(i), 2);
+        appendToPool(SEED_PRODUCTS[i].name);
+    }
+    putLittleEndian(image, layout.nameStartsOffset + SEED_COUNT * 4, poolEnd, 4);
+    uint32_t category = 0;
+    for (size_t i = 0; i < SEED_COUNT; ++i) {
+        if (seedFirstWithCategory(i) != i) continue;
+        putLittleEndian(image, layout.categoryStartsOffset + category++ * 4, poolEnd, 4);
+        appendToPool(SEED_PRODUCTS[i].category);
+    }
+    putLittleEndian(image, layout.categoryStartsOffset + category * 4, poolEnd, 4);
+    return image;
+}
+
+alignas(8) constexpr SeedImage SEED_CATALOG_IMAGE = buildSeedImage();
+
+// Perfect hash of the built-in IDs: a table of at least four slots per product, and the first
+// multiplier from a fixed sequence that sends every ID to its own slot
+constexpr size_t seedHashSlots() {
+    size_t slots = 8;
+    while (slots < SEED_COUNT * 4) slots *= 2;
+    return slots;
+}
+
+constexpr size_t SEED_HASH_SLOTS = seedHashSlots();
+constexpr int SEED_HASH_SHIFT = 64 - __builtin_ctzll(SEED_HASH_SLOTS);
+
+constexpr bool seedMultiplierWorks(uint64_t multiplier) {
+    bool used[SEED_HASH_SLOTS] = {};
+    for (const SeedProduct& product : SEED_PRODUCTS) {
+        uint64_t slot = (constPackId(product.id) * multiplier) >> SEED_HASH_SHIFT;
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr uint64_t findSeedMultiplier() {
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (int attempt = 0; attempt < 100000; ++attempt) {
+        // splitmix64 step; the multiplier is forced odd
+        state += 0x9E3779B97F4A7C15ull;
+        uint64_t candidate = state;
+        candidate = (candidate ^ (candidate >> 30)) * 0xBF58476D1CE4E5B9ull;
+        candidate = (candidate ^ (candidate >> 27)) * 0x94D049BB133111EBull;
+        candidate = (candidate ^ (candidate >> 31)) | 1;
+        if (seedMultiplierWorks(candidate)) return candidate;
+    }
+    return 0;
+}
+
+constexpr uint64_t SEED_HASH_MULTIPLIER = findSeedMultiplier();
+static_assert(SEED_HASH_MULTIPLIER != 0, "no perfect hash found for the built-in product IDs");
+
+constexpr array<int16_t, SEED_HASH_SLOTS> buildSeedHashSlots() {
+    array<int16_t, SEED_HASH_SLOTS> slots{};
+    for (size_t i = 0; i < SEED_HASH_SLOTS; ++i) slots[i] = -1;
+    for (size_t i = 0; i < SEED_COUNT; ++i) {
+        slots[(constPackId(SEED_PRODUCTS[i].id) * SEED_HASH_MULTIPLIER) >> SEED_HASH_SHIFT] = int16_t(i);
+    }
+    return slots;
+}
+
+constexpr array<int16_t, SEED_HASH_SLOTS> SEED_HASH_TABLE = buildSeedHashSlots();
+constexpr PerfectHashTable SEED_ID_HASH = {SEED_HASH_MULTIPLIER, SEED_HASH_SHIFT, SEED_HASH_TABLE.data()};
+
+// Lowercase an ASCII character without going through the locale
+inline char asciiLower(char c) {
+    return (c >= 'A' && c <= 'Z') ? char(c + ('a' - 'A')) : c;
+}
+
+// Pick the widest version of a kernel the CPU supports and name it in *kernelName. Builds
+// without the x86 vector kernels only have the scalar version.
+#ifdef BROKESTORE_X86_SIMD
+template <typename Kernel>
+Kernel pickKernel(Kernel scalar, Kernel sse2, Kernel avx2, const char** kernelName) {
+    const char* unused;
+    if (!kernelName) kernelName = &unused;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *kernelName = "avx2";
+        return avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *kernelName = "sse2";
+        return sse2;
+    }
+    *kernelName = "scalar";
+    return scalar;
+}
+#endif
+
+template <typename Kernel>
+Kernel pickKernel(Kernel scalar, const char** kernelName) {
+    if (kernelName) *kernelName = "scalar";
+    return scalar;
+}
+
+// Case-insensitive substring search kernels (ASCII folding, no allocation).
+// Each returns the position of the first match of an already-lowercased needle, or string_view::npos.
+// The vector versions test the needle's first and last character across a whole block at once
+// and only compare the middle of the needle at the positions where both match.
+typedef size_t (*FindIgnoreCaseFunction)(const char* text, size_t length, const char* needle, size_t needleLength);
+
+// Compare text against a lowercased needle, ignoring case
+inline bool equalsIgnoreCase(const char* text, const char* lowerNeedle, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (asciiLower(text[i]) != lowerNeedle[i]) return false;
+    }
+    return true;
+}
+
+size_t findIgnoreCaseScalar(const char* text, size_t length, const char* needle, size_t needleLength) {
+    if (needleLength == 0) return 0;
+    for (size_t i = 0; i + needleLength <= length; ++i) {
+        if (asciiLower(text[i]) == needle[0] && equalsIgnoreCase(text + i + 1, needle + 1, needleLength - 1)) {
+            return i;
+        }
+    }
+    return string_view::npos;
+}
+
+#ifdef BROKESTORE_X86_SIMD
+// Lowercase the letters in 16 bytes
+__attribute__((target("sse2"))) inline __m128i foldCase128(__m128i v) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), v));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2")))
+size_t findIgnoreCaseSse2(const char* text, size_t length, const char* needle, size_t needleLength) {
+    if (needleLength == 0) return 0;
+    if (needleLength > length) return string_view::npos;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+    size_t i = 0;
+    for (; i + needleLength - 1 + 16 <= length; i += 16) {
+        __m128i blockFirst = foldCase128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i)));
+        __m128i blockLast = foldCase128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + needleLength - 1)));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last)));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (equalsIgnoreCase(text + i + bit + 1, needle + 1, needleLength > 2 ? needleLength - 2 : 0)) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    size_t rest = findIgnoreCaseScalar(text + i, length - i, needle, needleLength);
+    return rest == string_view::npos ? rest : i + rest;
+}
+
+// Lowercase the letters in 32 bytes
+__attribute__((target("avx2"))) inline __m256i foldCase256(__m256i v) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+size_t findIgnoreCaseAvx2(const char* text, size_t length, const char* needle, size_t needleLength) {
+    if (needleLength == 0) return 0;
+    if (needleLength > length) return string_view::npos;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+    size_t i = 0;
+    for (; i + needleLength - 1 + 32 <= length; i += 32) {
+        __m256i blockFirst = foldCase256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i)));
+        __m256i blockLast = foldCase256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i + needleLength - 1)));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first), _mm256_cmpeq_epi8(blockLast, last)));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (equalsIgnoreCase(text + i + bit + 1, needle + 1, needleLength > 2 ? needleLength - 2 : 0)) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    size_t rest = findIgnoreCaseSse2(text + i, length - i, needle, needleLength);
+    return rest == string_view::npos ? rest : i + rest;
+}
+#endif
+
+FindIgnoreCaseFunction selectFindIgnoreCase(const char** kernelName = nullptr) {
+#ifdef BROKESTORE_X86_SIMD
+    return pickKernel(findIgnoreCaseScalar, findIgnoreCaseSse2, findIgnoreCaseAvx2, kernelName);
+#else
+    return pickKernel(findIgnoreCaseScalar, kernelName);
+#endif
+}
+
+// Find a lowercased needle in text, ignoring case, using the best kernel for this CPU
+inline size_t findIgnoreCase(string_view text, string_view lowerNeedle) {
+    static const FindIgnoreCaseFunction kernel = selectFindIgnoreCase();
+    return kernel(text.data(), text.length(), lowerNeedle.data(), lowerNeedle.length());
+}
+
+// Substring search over the names of products on sale, shared by every search and lookup path.
+// On first use it copies all names into one contiguous pool (each followed by a '\0', which a
+// search term never contains, so a match cannot run across two names) so that a plain search
+// is a single pass of the vectorized kernel over the pool.
+// Longer terms use a trigram index: for each 3-character sequence, the sorted list of products
+// whose name contains it. A query intersects the posting lists of its trigrams and only verifies
+// the survivors.
+class ProductSearchEngine {
+private:
+    const Catalog& catalog;
+    once_flag poolBuilt;
+    once_flag indexBuilt;
+    string namePool;                // all names back to back, '\0' after each
+    vector<uint32_t> nameStarts;    // start of each name in namePool, plus one end marker
+    vector<uint32_t> trigramKeys;   // distinct trigrams, sorted
+    vector<uint32_t> postingStarts; // start of each trigram's posting list, plus one end marker
+    vector<uint32_t> postings;      // product indexes, sorted within each list
+
+    static uint32_t trigramAt(const char* text) {
+        return (uint32_t(uint8_t(asciiLower(text[0]))) << 16) | (uint32_t(uint8_t(asciiLower(text[1]))) << 8) |
+               uint8_t(asciiLower(text[2]));
+    }
+
+    void ensurePool() {
+        call_once(poolBuilt, [this] { buildPool(); });
+    }
+
+    void ensureIndex() {
+        ensurePool();
+        call_once(indexBuilt, [this] { buildIndex(); });
+    }
+
+    void buildPool() {
+        uint32_t count = catalog.size();
+        nameStarts.resize(count + 1);
+        size_t totalLength = 0;
+        for (uint32_t i = 0; i < count; ++i) totalLength += catalog.name(i).length() + 1;
+        namePool.reserve(totalLength);
+        for (uint32_t i = 0; i < count; ++i) {
+            nameStarts[i] = namePool.size();
+            namePool += catalog.name(i);
+            namePool += '\0';
+        }
+        nameStarts[count] = namePool.size();
+    }
+
+    void buildIndex() {
+        vector<uint64_t> pairs; // (trigram << 32) | product index
+        for (uint32_t i = 0; i < catalog.size(); ++i) {
+            if (catalog.isRetired(i)) continue;
+            string_view name = nameAt(i);
+            for (size_t j = 0; j + 3 <= name.length(); ++j) {
+                pairs.push_back((uint64_t(trigramAt(name.data() + j)) << 32) | i);
+            }
+        }
+
+        sort(pairs.begin(), pairs.end());
+        pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end()); // a name may repeat a trigram
+
+        postings.reserve(pairs.size());
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            uint32_t key = uint32_t(pairs[i] >> 32);
+            if (trigramKeys.empty() || trigramKeys.back() != key) {
+                trigramKeys.push_back(key);
+                postingStarts.push_back(postings.size());
+            }
+            postings.push_back(uint32_t(pairs[i]));
+        }
+        postingStarts.push_back(postings.size());
+    }
+
+    string_view nameAt(uint32_t index) const {
+        return string_view(namePool.data() + nameStarts[index], nameStarts[index + 1] - nameStarts[index] - 1);
+    }
+
+    // Find the posting list of a trigram; returns false if no name contains it
+    bool postingList(uint32_t trigram, const uint32_t** begin, const uint32_t** end) const {
+        auto it = lower_bound(trigramKeys.begin(), trigramKeys.end(), trigram);
+        if (it == trigramKeys.end() || *it != trigram) return false;
+        size_t slot = it - trigramKeys.begin();
+        *begin = postings.data() + postingStarts[slot];
+        *end = postings.data() + postingStarts[slot + 1];
+        return true;
+    }
+
+    // Keep only the entries of `result` that also appear in [begin, end), galloping through the longer list
+    static void intersect(vector<uint32_t>& result, const uint32_t* begin, const uint32_t* end) {
+        size_t kept = 0;
+        for (uint32_t value : result) {
+            size_t step = 1;
+            const uint32_t* probe = begin;
+            while (probe + step < end && probe[step] < value) {
+                probe += step;
+                step *= 2;
+            }
+            begin = lower_bound(probe, min(probe + step + 1, end), value);
+            if (begin == end) break;
+            if (*begin == value) result[kept++] = value;
+        }
+        result.resize(kept);
+    }
+
+    // Scan the whole name pool with the substring kernel
+    vector<uint32_t> scanPool(string_view lowerTerm) {
+        vector<uint32_t> found;
+        size_t position = 0;
+        while (position < namePool.size()) {
+            size_t hit = findIgnoreCase(string_view(namePool).substr(position), lowerTerm);
+            if (hit == string_view::npos) break;
+            uint32_t index = upper_bound(nameStarts.begin(), nameStarts.end(), uint32_t(position + hit)) - nameStarts.begin() - 1;
+            if (!catalog.isRetired(index)) found.push_back(index);
+            position = nameStarts[index + 1]; // continue with the next name
+        }
+        return found;
+    }
+
+public:
+    ProductSearchEngine(const Catalog& catalog) : catalog(catalog) {}
+
+    // Lowercase a search term the same way names are compared
+    static string normalize(const string& term) {
+        string lower = term;
+        for (char& c : lower) c = asciiLower(c);
+        return lower;
+    }
+
+    // Check whether a product's name contains an already-normalized term
+    bool matches(ProductHandle index, string_view lowerTerm) const {
+        return findIgnoreCase(catalog.name(index), lowerTerm) != string_view::npos;
+    }
+
+    // All products whose name contains the term, in catalog order
+    vector<uint32_t> search(const string& term) {
+        string lowerTerm = normalize(term);
+        vector<uint32_t> found;
+        if (lowerTerm.empty()) { // everything on sale matches an empty term
+            found.reserve(catalog.activeCount());
+            for (uint32_t i = 0; i < catalog.size(); ++i) {
+                if (!catalog.isRetired(i)) found.push_back(i);
+            }
+            return found;
+        }
+        if (lowerTerm.find('\0') != string::npos) return found;
+
+        ensurePool();
+        if (lowerTerm.length() < 3) return scanPool(lowerTerm); // too short for the index
+
+        // Collect the posting list of every trigram in the term, shortest first
+        ensureIndex();
+        vector<pair<const uint32_t*, const uint32_t*>> lists;
+        for (size_t j = 0; j + 3 <= lowerTerm.length(); ++j) {
+            const uint32_t* begin;
+            const uint32_t* end;
+            if (!postingList(trigramAt(lowerTerm.data() + j), &begin, &end)) return found;
+            lists.emplace_back(begin, end);
+        }
+        sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) {
+            return a.second - a.first < b.second - b.first;
+        });
+
+        found.assign(lists[0].first, lists[0].second);
+        for (size_t j = 1; j < lists.size() && !found.empty(); ++j) {
+            intersect(found, lists[j].first, lists[j].second);
+        }
+
+        // Every trigram is present, now confirm they appear as one contiguous substring
+        size_t kept = 0;
+        for (uint32_t index : found) {
+            if (findIgnoreCase(nameAt(index), lowerTerm) != string_view::npos) found[kept++] = index;
+        }
+        found.resize(kept);
+        return found;
+    }
+
+    // First product (in catalog order, or in the given list) whose name contains the term
+    bool findFirst(const string& term, const ProductIndexSpan* availableProducts, ProductHandle* foundIndex) {
+        if (!availableProducts) {
+            vector<uint32_t> found = search(term);
+            if (found.empty()) return false;
+            *foundIndex = found[0];
+            return true;
+        }
+        string lowerTerm = normalize(term);
+        for (uint32_t index : *availableProducts) {
+            if (matches(index, lowerTerm)) {
+                *foundIndex = index;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Orders in which product lists can be shown
+enum class SortOrder { Catalog, PriceLowToHigh, PriceHighToLow, Name, Category };
+
+const char* sortOrderName(SortOrder order) {
+    switch (order) {
+        case SortOrder::PriceLowToHigh: return "price, low to high";
+        case SortOrder::PriceHighToLow: return "price, high to low";
+        case SortOrder::Name: return "name";
+        case SortOrder::Category: return "category";
+        default: return "catalog order";
+    }
+}
+
+// Cursor-based pagination over the whole catalog or a result list, in a chosen sort order.
+// A page is "the next pageSize products after the last one shown", so no page ever sorts or
+// copies the full list: catalog order is a direct slice, and sorted orders keep only the
+// pageSize best candidates in a bounded heap while streaming over the source once.
+class ProductPager {
+private:
+    const Catalog& catalog;
+    bool wholeCatalog;
+    ProductIndexSpan source;            // result list (unused for the whole catalog)
+    SortOrder sourceOrder;              // order the result list is already in
+    SortOrder order = SortOrder::Catalog;
+    size_t pageSize;
+    vector<ProductHandle> items;        // the current page
+    vector<pair<bool, ProductHandle>> pageCursors; // cursor each visited page started after
+
+    static int compareIgnoreCase(string_view a, string_view b) {
+        size_t length = min(a.length(), b.length());
+        for (size_t i = 0; i < length; ++i) {
+            char x = asciiLower(a[i]), y = asciiLower(b[i]);
+            if (x != y) return x < y ? -1 : 1;
+        }
+        return a.length() == b.length() ? 0 : (a.length() < b.length() ? -1 : 1);
+    }
+
+    // Strict ordering of two products under the current sort order; ties go by handle
+    bool before(ProductHandle a, ProductHandle b) const {
+        int difference = 0;
+        switch (order) {
+            case SortOrder::PriceLowToHigh:
+                difference = (catalog.priceCentavos(a) > catalog.priceCentavos(b)) - (catalog.priceCentavos(a) < catalog.priceCentavos(b));
+                break;
+            case SortOrder::PriceHighToLow:
+                difference = (catalog.priceCentavos(a) < catalog.priceCentavos(b)) - (catalog.priceCentavos(a) > catalog.priceCentavos(b));
+                break;
+            case SortOrder::Name:
+                difference = compareIgnoreCase(catalog.name(a), catalog.name(b));
+                break;
+            case SortOrder::Category:
+                difference = compareIgnoreCase(catalog.category(a), catalog.category(b));
+                if (difference == 0) difference = compareIgnoreCase(catalog.name(a), catalog.name(b));
+                break;
+            default:
+                break;
+        }
+        return difference != 0 ? difference < 0 : a < b;
+    }
+
+    size_t sourceSize() const {
+        return wholeCatalog ? catalog.activeCount() : source.size();
+    }
+
+    // Load the page that follows the given cursor
+    void fetchAfter(bool hasCursor, ProductHandle cursor) {
+        items.clear();
+        if (wholeCatalog && order == SortOrder::Catalog) {
+            for (size_t h = hasCursor ? cursor + 1 : 0; h < catalog.size() && items.size() < pageSize; ++h) {
+                if (!catalog.isRetired(h)) items.push_back(h);
+            }
+            return;
+        }
+        if (!wholeCatalog && order == sourceOrder) { // already sorted, the page is a slice
+            const ProductHandle* it = source.begin();
+            if (hasCursor) {
+                it = upper_bound(source.begin(), source.end(), cursor,
+                                 [this](ProductHandle a, ProductHandle b) { return before(a, b); });
+            }
+            for (; it != source.end() && items.size() < pageSize; ++it) items.push_back(*it);
+            return;
+        }
+
+        // Top-k selection: a max-heap (under `before`) of the best pageSize candidates so far
+        auto worse = [this](ProductHandle a, ProductHandle b) { return before(a, b); };
+        auto consider = [&](ProductHandle h) {
+            if (hasCursor && !before(cursor, h)) return; // already shown on an earlier page
+            if (items.size() < pageSize) {
+                items.push_back(h);
+                push_heap(items.begin(), items.end(), worse);
+            } else if (before(h, items.front())) {
+                pop_heap(items.begin(), items.end(), worse);
+                items.back() = h;
+                push_heap(items.begin(), items.end(), worse);
+            }
+        };
+        if (wholeCatalog) {
+            for (ProductHandle h = 0; h < catalog.size(); ++h) {
+                if (!catalog.isRetired(h)) consider(h);
+            }
+        } else {
+            for (ProductHandle h : source) consider(h);
+        }
+        sort_heap(items.begin(), items.end(), worse);
+    }
+
+public:
+    // Page through the whole catalog
+    ProductPager(const Catalog& catalog, size_t pageSize = 10)
+        : catalog(catalog), wholeCatalog(true), sourceOrder(SortOrder::Catalog), pageSize(pageSize) {
+        firstPage();
+    }
+
+    // Page through a result list that is already sorted in `sourceOrder` (search and category
+    // results are in catalog order, price ranges cheapest first); it starts out in that order
+    ProductPager(const Catalog& catalog, ProductIndexSpan source, SortOrder sourceOrder = SortOrder::Catalog,
+                 size_t pageSize = 10)
+        : catalog(catalog), wholeCatalog(false), source(source), sourceOrder(sourceOrder),
+          order(sourceOrder), pageSize(pageSize) {
+        firstPage();
+    }
+
+    void firstPage() {
+        pageCursors.assign(1, make_pair(false, ProductHandle(0)));
+        fetchAfter(false, 0);
+    }
+
+    // Change the sort order and go back to the first page
+    void setOrder(SortOrder newOrder) {
+        order = newOrder;
+        firstPage();
+    }
+
+    // Move to the next page; returns false on the last page
+    bool next() {
+        if (items.empty() || pageNumber() >= pageCount()) return false;
+        ProductHandle cursor = items.back();
+        pageCursors.push_back(make_pair(true, cursor));
+        fetchAfter(true, cursor);
+        return true;
+    }
+
+    // Move back to the previous page; returns false on the first page
+    bool previous() {
+        if (pageCursors.size() <= 1) return false;
+        pageCursors.pop_back();
+        fetchAfter(pageCursors.back().first, pageCursors.back().second);
+        return true;
+    }
+
+    ProductIndexSpan page() const { return ProductIndexSpan(items); }
+    SortOrder sortOrder() const { return order; }
+    size_t pageNumber() const { return pageCursors.size(); }
+    size_t pageCount() const { return max<size_t>(1, (sourceSize() + pageSize - 1) / pageSize); }
+    size_t totalProducts() const { return sourceSize(); }
+};
+
+// Epoch-based reclamation for objects that readers use without locks.
+// A reader publishes the global epoch in a slot before it loads a shared pointer and clears the
+// slot when done. A writer that unlinks an object retires it in the current epoch and advances the
+// epoch; the object is freed once every occupied slot shows a later epoch, because any reader that
+// could still see it entered no later than the epoch it was retired in.
+// When every slot is taken, a new reader sleeps until one is given back.
+class EpochManager {
+private:
+    static const int MAX_READERS = 256;
+    struct alignas(64) ReaderSlot {
+        atomic<uint64_t> epoch{0}; // 0 = not reading
+        atomic<bool> taken{false};
+    };
+
+    atomic<uint64_t> globalEpoch{1};
+    ReaderSlot slots[MAX_READERS];
+    mutex retiredMutex; // writers only
+    vector<pair<uint64_t, function<void()>>> retired;
+    mutex slotMutex; // only for readers waiting for a free slot
+    condition_variable slotFreed;
+    atomic<int> waitingReaders{0};
+
+    // One pass over the slots; -1 if all are taken
+    int tryTakeSlot() {
+        for (int i = 0; i < MAX_READERS; ++i) {
+            bool expected = false;
+            if (!slots[i].taken.load(memory_order_relaxed) && slots[i].taken.compare_exchange_strong(expected, true)) {
+                slots[i].epoch.store(globalEpoch.load());
+                return i;
+            }
+        }
+        return -1;
+    }
+
+public:
+    ~EpochManager() {
+        for (auto& entry : retired) entry.second();
+    }
+
+    // Start reading; returns the slot to pass to exit()
+    int enter() {
+        int slot = tryTakeSlot();
+        if (slot >= 0) return slot;
+        unique_lock<mutex> guard(slotMutex);
+        waitingReaders.fetch_add(1);
+        // A reader leaving after the count went up sees it and wakes us; one that left before
+        // freed a slot this pass will find
+        while ((slot = tryTakeSlot()) < 0) slotFreed.wait(guard);
+        waitingReaders.fetch_sub(1);
+        return slot;
+    }
+
+    void exit(int slot) {
+        slots[slot].epoch.store(0);
+        slots[slot].taken.store(false);
+        if (waitingReaders.load() > 0) {
+            lock_guard<mutex> guard(slotMutex);
+            slotFreed.notify_one();
+        }
+    }
+
+    // Hand over an unlinked object; `free` runs once no reader can still hold it
+    void retire(function<void()> free) {
+        lock_guard<mutex> lock(retiredMutex);
+        retired.emplace_back(globalEpoch.fetch_add(1), move(free));
+        reclaimLocked();
+    }
+
+    // Free whatever retired objects are no longer visible to any reader
+    void reclaim() {
+        lock_guard<mutex> lock(retiredMutex);
+        reclaimLocked();
+    }
+
+private:
+    void reclaimLocked() {
+        uint64_t oldestReader = UINT64_MAX;
+        for (const ReaderSlot& slot : slots) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != 0) oldestReader = min(oldestReader, epoch);
+        }
+        size_t kept = 0;
+        for (auto& entry : retired) {
+            if (entry.first < oldestReader) {
+                entry.second();
+            } else {
+                retired[kept++] = move(entry);
+            }
+        }
+        retired.resize(kept);
+    }
+};
+
+// One immutable version of the catalog together with its lookup structures.
+// The lookup structures are still built lazily, but only once and thread-safely.
+struct CatalogSnapshot {
+    uint64_t version = 1;
+    Catalog catalog;
+    ProductSearchEngine search{catalog};
+    CategoryIndex categories{catalog};
+    ProductIdIndex ids{catalog};
+    PriceIndex prices{catalog};
+};
+
+// Holds the current catalog snapshot. Readers pin a snapshot without taking any lock and keep
+// seeing that version for as long as they hold it; admin changes build a complete new snapshot
+// and publish it with one atomic pointer swap. Old snapshots are freed through epoch reclamation.
+// With a catalog file set, every change is written to it before it is published, so a change
+// shoppers have seen (and orders may name) is never lost in a restart.
+class CatalogStore {
+private:
+    atomic<CatalogSnapshot*> current{nullptr};
+    EpochManager epochs;
+    mutex writerMutex; // serializes admin changes; readers never take it
+    string path;       // where changes are saved; empty keeps them in memory only
+
+public:
+    // A pinned snapshot, released when the reader goes out of scope
+    class Reader {
+    private:
+        CatalogStore* store = nullptr;
+        int slot = -1;
+        CatalogSnapshot* snapshot = nullptr; // the catalog is immutable; only the lazy lookups fill in
+
+        void release() {
+            if (store) store->epochs.exit(slot);
+            store = nullptr;
+            snapshot = nullptr;
+        }
+
+    public:
+        Reader() {}
+        Reader(CatalogStore* store) : store(store), slot(store->epochs.enter()), snapshot(store->current.load()) {}
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+        Reader(Reader&& other) : store(other.store), slot(other.slot), snapshot(other.snapshot) {
+            other.store = nullptr;
+            other.snapshot = nullptr;
+        }
+        Reader& operator=(Reader&& other) {
+            if (this != &other) {
+                release();
+                store = other.store;
+                slot = other.slot;
+                snapshot = other.snapshot;
+                other.store = nullptr;
+                other.snapshot = nullptr;
+            }
+            return *this;
+        }
+        ~Reader() {
+            release();
+        }
+
+        CatalogSnapshot* operator->() const { return snapshot; }
+        CatalogSnapshot& operator*() const { return *snapshot; }
+    };
+
+    CatalogStore() {}
+    CatalogStore(const CatalogStore&) = delete;
+    CatalogStore& operator=(const CatalogStore&) = delete;
+
+    ~CatalogStore() {
+        delete current.load();
+    }
+
+    // Pin the current snapshot
+    Reader read() {
+        return Reader(this);
+    }
+
+    // Free retired snapshots that no reader pins any more; call after dropping a pin, since a
+    // snapshot retired while pinned is otherwise only freed by the next publish
+    void reclaim() {
+        epochs.reclaim();
+    }
+
+    // Save every later change to this catalog file
+    void saveChangesTo(const string& catalogPath) {
+        lock_guard<mutex> lock(writerMutex);
+        path = catalogPath;
+    }
+
+    // Make a new snapshot the current one
+    void publish(unique_ptr<CatalogSnapshot> next) {
+        CatalogSnapshot* old = current.exchange(next.release());
+        if (old) epochs.retire([old] { delete old; });
+    }
+
+    // Apply a change to a copy of the current product rows and publish the result.
+    // Rows keep their positions, so product handles held by carts and orders stay valid.
+    bool update(const function<bool(vector<Product>&, string*)>& change, string* errorMessage) {
+        lock_guard<mutex> lock(writerMutex);
+        Reader base = read();
+        vector<Product> products = base->catalog.toProducts();
+        if (!change(products, errorMessage)) return false;
+
+        vector<char> image;
+        if (!Catalog::serialize(products, &image, errorMessage)) return false;
+        if (!path.empty() && !replaceFileDurably(path, string_view(image.data(), image.size()), errorMessage)) {
+            *errorMessage = "The catalog was not changed: " + *errorMessage;
+            return false;
+        }
+        unique_ptr<CatalogSnapshot> next(new CatalogSnapshot());
+        if (!next->catalog.loadImage(move(image), errorMessage)) return false;
+        next->version = base->version + 1;
+        publish(move(next));
+        return true;
+    }
+
+    // Find the row of an existing product by ID (retired products included)
+    static Product* findRow(vector<Product>& products, const string& id) {
+        for (auto& product : products) {
+            if (product.id == id) return &product;
+        }
+        return nullptr;
+    }
+
+    // Add a new product
+    bool addProduct(const Product& product, string* errorMessage) {
+        return update([&](vector<Product>& products, string* error) {
+            if (findRow(products, product.id)) {
+                *error = "A product with ID " + product.id + " already exists.";
+                return false;
+            }
+            products.push_back(product);
+            return true;
+        }, errorMessage);
+    }
+
+    // Change the price of a product; past orders keep the price they were bought at
+    bool changePrice(const string& id, Money newPrice, string* errorMessage) {
+        return update([&](vector<Product>& products, string* error) {
+            Product* row = findRow(products, id);
+            if (!row || row->retired) {
+                *error = "Product " + id + " not found.";
+                return false;
+            }
+            row->price = newPrice;
+            return true;
+        }, errorMessage);
+    }
+
+    // Stop selling a product; it stays in the catalog so past orders can still show it
+    bool retireProduct(const string& id, string* errorMessage) {
+        return update([&](vector<Product>& products, string* error) {
+            Product* row = findRow(products, id);
+            if (!row || row->retired) {
+                *error = "Product " + id + " not found.";
+                return false;
+            }
+            row->retired = true;
+            return true;
+        }, errorMessage);
+    }
+};
+
+// Struct representing an item that has been purchased
+// The product is a catalog handle; its price at the time of purchase is snapshotted here
+struct PurchasedItem {
+    ProductHandle product;
+    int quantity;
+    Money priceAtPurchase;
+};
+
+// Class representing an order made by a user
+class Order {
+public:
+    long long orderNumber;
+    time_t orderTime;
+    string buyerName;
+    string buyerPhone;
+    string paymentMethod;
+    vector<PurchasedItem> purchasedItems;
+    Money totalPrice;
+    int totalQuantity;
+
+// Empty order, filled in when one is read back from the journal
+Order() : orderNumber(0), orderTime(0), totalQuantity(0) {}
+
+// Constructor to initialize an order
+Order(long long orderNumber,
+    time_t orderTime,
+    const string& buyerName,
+    const string& buyerPhone,
+    const string& paymentMethod,
+    const vector<PurchasedItem>& purchasedItems,
+    Money totalPrice,
+    int totalQuantity)
+    : orderNumber(orderNumber),
+    orderTime(orderTime),
+    buyerName(buyerName),
+    buyerPhone(buyerPhone),
+    paymentMethod(paymentMethod),
+    purchasedItems(purchasedItems),
+    totalPrice(totalPrice),
+    totalQuantity(totalQuantity) {}
+};
+
+// Snowflake-style order numbers: [41 bits milliseconds since 2024-01-01][10 bits node][12 bits
+// sequence]. The last number handed out is one atomic word and next() advances it with a
+// compare-and-swap, so concurrent checkouts never share a number and never block each other.
+// Numbers only go up on a node: if the clock steps back, or 4096 numbers are taken within one
+// millisecond, the generator keeps counting from the last timestamp it used until the clock
+// catches up.
+class OrderIdGenerator {
+private:
+    static constexpr int SEQUENCE_BITS = 12;
+    static constexpr int NODE_BITS = 10;
+    static constexpr uint64_t SEQUENCE_MASK = (1ull << SEQUENCE_BITS) - 1;
+    static constexpr uint64_t EPOCH_MILLISECONDS = 1704067200000ull; // 2024-01-01T00:00:00Z
+
+    uint64_t nodeBits;
+    atomic<uint64_t> last{0};
+
+    static uint64_t millisecondsSinceEpoch() {
+        uint64_t now = chrono::duration_cast<chrono::milliseconds>(
+                           chrono::system_clock::now().time_since_epoch()).count();
+        return now > EPOCH_MILLISECONDS ? now - EPOCH_MILLISECONDS : 0;
+    }
+
+public:
+    static constexpr uint32_t MAX_NODE = (1u << NODE_BITS) - 1;
+
+    OrderIdGenerator(uint32_t node) : nodeBits(uint64_t(node & MAX_NODE) << SEQUENCE_BITS) {}
+
+    long long next() {
+        uint64_t previous = last.load(memory_order_relaxed);
+        uint64_t candidate;
+        do {
+            candidate = millisecondsSinceEpoch() << (NODE_BITS + SEQUENCE_BITS) | nodeBits;
+            if (candidate <= previous) {
+                // Same millisecond or the clock went back: continue after the last number,
+                // moving on to the next millisecond once the sequence is used up
+                candidate = (previous & SEQUENCE_MASK) == SEQUENCE_MASK
+                                ? ((previous >> (NODE_BITS + SEQUENCE_BITS)) + 1) << (NODE_BITS + SEQUENCE_BITS) | nodeBits
+                                : previous + 1;
+            }
+        } while (!last.compare_exchange_weak(previous, candidate, memory_order_relaxed));
+        return (long long)candidate;
+    }
+
+    static uint32_t nodeOf(long long id) {
+        return uint32_t(uint64_t(id) >> SEQUENCE_BITS) & MAX_NODE;
+    }
+};
+
+// CRC-32 (IEEE, reflected), table built at compile time
+struct Crc32Table {
+    uint32_t entries[256];
+
+    constexpr Crc32Table() : entries() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0);
+            entries[i] = crc;
+        }
+    }
+};
+
+constexpr Crc32Table CRC32_TABLE;
+
+inline uint32_t crc32(const char* data, size_t length) {
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i) crc = CRC32_TABLE.entries[(crc ^ uint8_t(data[i])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Append fixed-size values and length-prefixed strings to a binary record
+template <typename T>
+void appendValue(string* out, T value) {
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline void appendString(string* out, const string& text) {
+    appendValue<uint32_t>(out, text.size());
+    out->append(text);
+}
+
+// Bounds-checked reader over a binary record; every read fails once the record runs short
+class RecordReader {
+private:
+    string_view rest;
+
+public:
+    RecordReader(string_view record) : rest(record) {}
+
+    template <typename T>
+    bool read(T* value) {
+        if (rest.size() < sizeof(T)) return false;
+        memcpy(value, rest.data(), sizeof(T));
+        rest.remove_prefix(sizeof(T));
+        return true;
+    }
+
+    bool readString(string* text) {
+        uint32_t length;
+        if (!read(&length) || rest.size() < length) return false;
+        text->assign(rest.data(), length);
+        rest.remove_prefix(length);
+        return true;
+    }
+
+    bool atEnd() const { return rest.empty(); }
+};
+
+// Serialize an order. Products are stored by packed ID rather than handle so the order can be
+// matched up with whatever catalog is loaded when it is read back.
+void appendOrder(string* out, const Order& order, const Catalog& catalog) {
+    appendValue<int64_t>(out, order.orderNumber);
+    appendValue<int64_t>(out, order.orderTime);
+    appendString(out, order.buyerName);
+    appendString(out, order.buyerPhone);
+    appendString(out, order.paymentMethod);
+    appendValue<int64_t>(out, order.totalPrice.centavos());
+    appendValue<int32_t>(out, order.totalQuantity);
+    appendValue<uint32_t>(out, order.purchasedItems.size());
+    for (const PurchasedItem& item : order.purchasedItems) {
+        appendValue<uint64_t>(out, catalog.packedId(item.product));
+        appendValue<int32_t>(out, item.quantity);
+        appendValue<int64_t>(out, item.priceAtPurchase.centavos());
+    }
+}
+
+// Read an order written by appendOrder; items whose product is not in the catalog are dropped and counted
+bool readOrder(RecordReader& reader, const FlatIndexMap& handleOfId, Order* order, size_t* missingProducts) {
+    int64_t orderNumber, orderTime, totalCentavos;
+    int32_t totalQuantity;
+    uint32_t itemCount;
+    string buyerName, buyerPhone, paymentMethod;
+    if (!reader.read(&orderNumber) || !reader.read(&orderTime) || !reader.readString(&buyerName) ||
+        !reader.readString(&buyerPhone) || !reader.readString(&paymentMethod) || !reader.read(&totalCentavos) ||
+        !reader.read(&totalQuantity) || !reader.read(&itemCount)) {
+        return false;
+    }
+    vector<PurchasedItem> items;
+    for (uint32_t i = 0; i < itemCount; ++i) {
+        uint64_t packedId;
+        int32_t quantity;
+        int64_t priceCentavos;
+        if (!reader.read(&packedId) || !reader.read(&quantity) || !reader.read(&priceCentavos)) return false;
+        ProductHandle product;
+        if (!handleOfId.find(packedId, &product)) {
+            ++*missingProducts;
+            continue;
+        }
+        items.push_back({product, quantity, Money::fromCentavos(priceCentavos)});
+    }
+    *order = Order(orderNumber, time_t(orderTime), buyerName, buyerPhone, paymentMethod, items,
+                   Money::fromCentavos(totalCentavos), totalQuantity);
+    return true;
+}
+
+// Map every product ID in a catalog (retired ones included) to its handle, for reading stored orders
+FlatIndexMap handlesById(const Catalog& catalog) {
+    FlatIndexMap handleOfId;
+    handleOfId.reserve(catalog.size());
+    for (ProductHandle i = 0; i < catalog.size(); ++i) handleOfId.insert(catalog.packedId(i), i);
+    return handleOfId;
+}
+
+// A journal record: the buyer's email followed by the order
+string encodeOrderRecord(const string& email, const Order& order, const Catalog& catalog) {
+    string record;
+    appendString(&record, email);
+    appendOrder(&record, order, catalog);
+    return record;
+}
+
+bool decodeOrderRecord(string_view record, const FlatIndexMap& handleOfId, string* email, Order* order,
+                       size_t* missingProducts) {
+    RecordReader reader(record);
+    return reader.readString(email) && readOrder(reader, handleOfId, order, missingProducts) && reader.atEnd();
+}
+
+// A store snapshot file, kept mapped while some purchase histories in it are still undecoded
+struct SnapshotSource {
+    MappedFile file;
+    FlatIndexMap handleOfId; // product IDs of the catalog the snapshot is restored into
+    mutex decodeLock;
+    atomic<size_t> damagedHistories{0}; // skipped on decoding, which may happen on any thread
+};
+
+// One user's purchase history still in its encoded form inside a snapshot; it is decoded the
+// first time the history is needed, so a restored store takes logins before any is decoded
+class LazyHistory {
+private:
+    shared_ptr<SnapshotSource> source;
+    string_view blob;
+    uint32_t orderCount;
+    uint32_t checksum;
+    bool decoded = false;
+
+public:
+    LazyHistory(shared_ptr<SnapshotSource> source, string_view blob, uint32_t orderCount, uint32_t checksum)
+        : source(move(source)), blob(blob), orderCount(orderCount), checksum(checksum) {}
+
+    // Put the stored orders in front of any added since the restore (only the first call does anything)
+    void decodeInto(vector<Order>* history) {
+        lock_guard<mutex> guard(source->decodeLock);
+        if (decoded) return;
+        decoded = true;
+        if (crc32(blob.data(), blob.size()) != checksum) {
+            source->damagedHistories.fetch_add(1);
+            return;
+        }
+        vector<Order> orders;
+        orders.reserve(orderCount + history->size());
+        RecordReader reader(blob);
+        size_t missingProducts = 0;
+        for (uint32_t i = 0; i < orderCount; ++i) {
+            Order order;
+            if (!readOrder(reader, source->handleOfId, &order, &missingProducts)) break;
+            orders.push_back(move(order));
+        }
+        for (Order& order : *history) orders.push_back(move(order));
+        history->swap(orders);
+    }
+
+    // The encoded orders if they were never decoded, so a new snapshot can copy them as they are
+    bool pendingBlob(string_view* encoded, uint32_t* count) {
+        lock_guard<mutex> guard(source->decodeLock);
+        if (decoded) return false;
+        *encoded = blob;
+        *count = orderCount;
+        return true;
+    }
+};
+
+// Where a snapshot leaves off in the order journal: the journal it was taken against, the offset
+// from which records still have to be replayed, and the records after that offset whose orders
+// the snapshot already holds (they were delivered while an earlier order was still on its way).
+struct JournalPosition {
+    uint64_t journalId = 0;
+    uint64_t offset = 0;              // 0 replays the whole journal
+    vector<uint64_t> alreadyApplied;  // sorted record offsets to skip
+};
+
+// Append-only file of checksummed records: a 16-byte header (file tag and a random journal ID,
+// new every time the journal is started afresh), then per record
+// [uint32_t payload length][uint32_t CRC-32 of the payload][payload].
+// Committers hand records to a background writer and wait; the writer takes everything queued
+// so far (optionally lingering for a batch window to collect more), writes it, and makes it
+// durable with a single fsync, then wakes every committer in that batch (group commit).
+// A committer that applies its record to memory later reports it with markApplied, so cut()
+// can tell a snapshot exactly which records its in-memory state already holds.
+class OrderJournal {
+private:
+    static constexpr char FILE_TAG[8] = {'N', 'B', 'J', 'R', 'N', 'L', '2', '\0'};
+    static constexpr char OLD_FILE_TAG[8] = {'N', 'B', 'J', 'R', 'N', 'L', '1', '\0'}; // no ID, 8-byte header
+
+    int fd = -1;
+    mutex lock;
+    condition_variable wakeWriter;
+    condition_variable batchDurable;
+    string pending;                  // framed records waiting for the writer
+    uint64_t queuedCount = 0;        // records handed in so far
+    uint64_t durableCount = 0;       // records known to be on disk
+    uint64_t batchCount = 0;
+    uint64_t fileEnd = 0;            // bytes of the file that are durable
+    uint64_t queuedEnd = 0;          // where the next record handed in will start
+    uint64_t journalId = 0;
+    set<uint64_t> unapplied;         // offsets of records not yet applied to memory by their committer
+    set<uint64_t> appliedAhead;      // applied records after the first unapplied one
+    bool failed = false;             // a write or sync failed; nothing is acknowledged after that
+    bool stopping = false;
+    chrono::microseconds batchWindow{0};
+    thread writer;
+
+    static uint64_t newJournalId() {
+        random_device device;
+        uint64_t id;
+        do {
+            id = (uint64_t(device()) << 32 | device()) ^ uint64_t(chrono::steady_clock::now().time_since_epoch().count());
+        } while (id == 0); // 0 stands for a journal from before IDs
+        return id;
+    }
+
+    bool writeAll(const string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+#ifdef _WIN32
+            int result = _write(fd, data.data() + written, unsigned(min<size_t>(data.size() - written, INT32_MAX)));
+#else
+            ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+#endif
+            if (result <= 0) return false;
+            written += result;
+        }
+        return true;
+    }
+
+    bool sync() {
+#ifdef _WIN32
+        return _commit(fd) == 0;
+#else
+        return fsync(fd) == 0;
+#endif
+    }
+
+    bool truncateTo(uint64_t length) {
+#ifdef _WIN32
+        return _chsize_s(fd, length) == 0 && _lseeki64(fd, length, SEEK_SET) >= 0;
+#else
+        return ftruncate(fd, length) == 0 && lseek(fd, length, SEEK_SET) >= 0;
+#endif
+    }
+
+    void writerLoop() {
+        string batch;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wakeWriter.wait(guard, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) break; // stopping with nothing left to write
+            if (batchWindow.count() > 0 && !stopping) {
+                guard.unlock();
+                this_thread::sleep_for(batchWindow); // let more committers join this batch
+                guard.lock();
+            }
+            batch.swap(pending);
+            uint64_t batchEnd = queuedCount;
+            guard.unlock();
+            bool ok = writeAll(batch) && sync();
+            guard.lock();
+            if (!ok) failed = true;
+            if (ok) fileEnd += batch.size();
+            batch.clear();
+            durableCount = batchEnd;
+            ++batchCount;
+            batchDurable.notify_all();
+        }
+    }
+
+    // Record that the record at `start` is in memory (or never will be)
+    void settle(uint64_t start) {
+        if (unapplied.erase(start) == 0) return; // never queued
+        if (!unapplied.empty() && start > *unapplied.begin()) appliedAhead.insert(start);
+        if (unapplied.empty()) {
+            appliedAhead.clear();
+        } else {
+            appliedAhead.erase(appliedAhead.begin(), appliedAhead.lower_bound(*unapplied.begin()));
+        }
+    }
+
+public:
+    OrderJournal() {}
+    OrderJournal(const OrderJournal&) = delete;
+    OrderJournal& operator=(const OrderJournal&) = delete;
+
+    ~OrderJournal() {
+        close();
+    }
+
+    // Open (or create) the journal, cut off a torn tail left by a crash, pass the records a
+    // snapshot taken at `from` does not hold to replay in order, and start the writer.
+    // A journal other than the one the snapshot was taken against (replaced, or recreated after
+    // being lost) is replayed in full. The snapshot's own journal ending before `from` has lost
+    // records the snapshot already holds; appending to it would put new orders at offsets the
+    // snapshot treats as replayed, so it is started afresh under a new ID instead.
+    bool open(const string& path, const JournalPosition& from, const function<void(string_view)>& replay,
+              string* errorMessage) {
+        close();
+        string contents;
+        {
+            ifstream in(path, ios::binary);
+            if (in) contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        }
+        size_t headerSize = sizeof(FILE_TAG) + sizeof(uint64_t);
+        uint64_t fileId = 0;
+        if (!contents.empty()) {
+            if (contents.size() >= headerSize && memcmp(contents.data(), FILE_TAG, sizeof(FILE_TAG)) == 0) {
+                memcpy(&fileId, contents.data() + sizeof(FILE_TAG), sizeof(fileId));
+            } else if (contents.size() >= sizeof(OLD_FILE_TAG) &&
+                       memcmp(contents.data(), OLD_FILE_TAG, sizeof(OLD_FILE_TAG)) == 0) {
+                headerSize = sizeof(OLD_FILE_TAG);
+            } else {
+                *errorMessage = path + " is not an order journal.";
+                return false;
+            }
+        }
+
+        // Find where the intact records end before deciding what to replay
+        vector<pair<size_t, uint32_t>> records; // payload offset and length
+        size_t validEnd = contents.empty() ? 0 : headerSize;
+        while (validEnd != 0 && contents.size() - validEnd >= 8) {
+            uint32_t length, checksum;
+            memcpy(&length, contents.data() + validEnd, 4);
+            memcpy(&checksum, contents.data() + validEnd + 4, 4);
+            if (length > contents.size() - validEnd - 8) break;
+            const char* payload = contents.data() + validEnd + 8;
+            if (crc32(payload, length) != checksum) break;
+            records.push_back({validEnd + 8, length});
+            validEnd += 8 + length;
+        }
+
+        bool startAfresh = validEnd == 0;
+        uint64_t replayFrom = 0;
+        if (!startAfresh && from.offset != 0 && fileId == from.journalId) {
+            if (validEnd < from.offset) {
+                startAfresh = true;
+            } else {
+                replayFrom = from.offset;
+            }
+        }
+        if (!startAfresh) {
+            for (const auto& record : records) {
+                uint64_t start = record.first - 8;
+                if (start < replayFrom) continue;
+                if (replayFrom != 0 &&
+                    binary_search(from.alreadyApplied.begin(), from.alreadyApplied.end(), start)) continue;
+                replay(string_view(contents.data() + record.first, record.second));
+            }
+        }
+
+#ifdef _WIN32
+        fd = _open(path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+#endif
+        if (fd < 0) {
+            *errorMessage = "Cannot open " + path + " for writing.";
+            return false;
+        }
+        bool prepared;
+        if (startAfresh) {
+            fileId = newJournalId();
+            string header(FILE_TAG, sizeof(FILE_TAG));
+            appendValue<uint64_t>(&header, fileId);
+            prepared = truncateTo(0) && writeAll(header) && sync();
+            validEnd = header.size();
+        } else {
+            prepared = truncateTo(validEnd);
+        }
+        if (!prepared) {
+            *errorMessage = "Cannot prepare " + path + ".";
+            close();
+            return false;
+        }
+        stopping = false;
+        failed = false;
+        journalId = fileId;
+        fileEnd = validEnd;
+        queuedEnd = validEnd;
+        unapplied.clear();
+        appliedAhead.clear();
+        writer = thread([this] { writerLoop(); });
+        return true;
+    }
+
+    // Finish pending writes and close the file
+    void close() {
+        if (writer.joinable()) {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            wakeWriter.notify_one();
+            writer.join();
+        }
+        if (fd >= 0) {
+#ifdef _WIN32
+            _close(fd);
+#else
+            ::close(fd);
+#endif
+            fd = -1;
+        }
+    }
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    // How long the writer waits for more commits before each write; 0 writes as soon as possible
+    void setBatchWindow(chrono::microseconds window) {
+        lock_guard<mutex> guard(lock);
+        batchWindow = window;
+    }
+
+    // Append a record and return once it is durable on disk. The record counts as not yet in
+    // memory until markApplied(*recordStart) is called, which must happen whether or not the
+    // commit succeeded.
+    bool commit(const string& record, uint64_t* recordStart, string* errorMessage) {
+        unique_lock<mutex> guard(lock);
+        if (fd < 0 || failed) {
+            *errorMessage = "The order journal is not writable.";
+            *recordStart = queuedEnd;
+            return false;
+        }
+        appendValue<uint32_t>(&pending, record.size());
+        appendValue<uint32_t>(&pending, crc32(record.data(), record.size()));
+        pending += record;
+        *recordStart = queuedEnd;
+        queuedEnd += 8 + record.size();
+        unapplied.insert(*recordStart);
+        uint64_t ticket = ++queuedCount;
+        wakeWriter.notify_one();
+        batchDurable.wait(guard, [this, ticket] { return durableCount >= ticket; });
+        if (failed) {
+            *errorMessage = "Writing the order journal failed.";
+            return false;
+        }
+        return true;
+    }
+
+    // Append a record that needs no applying and return once it is durable on disk
+    bool commit(const string& record, string* errorMessage) {
+        uint64_t start;
+        bool ok = commit(record, &start, errorMessage);
+        markApplied(start);
+        return ok;
+    }
+
+    // The record committed at `start` is now in memory, or was dropped
+    void markApplied(uint64_t start) {
+        lock_guard<mutex> guard(lock);
+        settle(start);
+    }
+
+    // The position of what is in memory right now. Callers hold off markApplied (for example by
+    // holding the lock their committers apply under) while they copy that state.
+    JournalPosition cut() {
+        lock_guard<mutex> guard(lock);
+        JournalPosition position;
+        position.journalId = journalId;
+        position.offset = unapplied.empty() ? fileEnd : min(*unapplied.begin(), fileEnd);
+        // Records past fileEnd never became durable; their offsets will be reused
+        position.alreadyApplied.assign(appliedAhead.lower_bound(position.offset), appliedAhead.lower_bound(fileEnd));
+        return position;
+    }
+
+    // Number of fsync batches written so far
+    uint64_t batches() {
+        lock_guard<mutex> guard(lock);
+        return batchCount;
+    }
+};
+
+// One cart line: a product, how many of it, and its unit price when the line was last priced
+struct CartLine {
+    ProductHandle product;
+    int quantity;
+    Money unitPrice;
+
+    Money subtotal() const { return unitPrice * quantity; }
+};
+
+// Class representing a shopping cart. Lines are kept in the order they were added, with a
+// flat map from product handle to line; both keep their capacity when emptied, so once a
+// cart has held its largest order, no cart operation allocates. The item count and price
+// total are kept up to date by every change, so reading them is O(1).
+class ShoppingCart {
+private:
+    vector<CartLine> items;
+    FlatIndexMap lineOfProduct; // product handle -> position in items
+    int quantityTotal = 0;
+    Money priceTotal;
+    uint64_t priceVersion = 0;  // catalog version the unit prices were taken from
+
+    // Rebuild the lookup after items were replaced or compacted
+    void reindex() {
+        lineOfProduct.clear();
+        for (size_t i = 0; i < items.size(); ++i) {
+            lineOfProduct.insert(items[i].product, i);
+        }
+    }
+
+    // Recount the totals from scratch
+    void recomputeTotals(int* quantity, Money* price) const {
+        *quantity = 0;
+        *price = Money();
+        for (const auto& item : items) {
+            *quantity += item.quantity;
+            *price += item.subtotal();
+        }
+    }
+
+    // Builds with BROKESTORE_CHECK_CART defined compare the running totals and the lookup with
+    // a full recount after every change; that is O(n) per edit, so it is off unless asked for
+    void checkInvariants() const {
+#ifdef BROKESTORE_CHECK_CART
+        int quantity;
+        Money price;
+        recomputeTotals(&quantity, &price);
+        assert(quantity == quantityTotal && price == priceTotal);
+        assert(lineOfProduct.size() == items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            uint32_t line;
+            assert(lineOfProduct.find(items[i].product, &line) && line == i);
+        }
+#endif
+    }
+
+public: // Add an item to the cart
+    void addItem(ProductHandle product, int quantity, Money unitPrice) {
+        uint32_t line;
+        if (lineOfProduct.find(product, &line)) {
+            items[line].quantity += quantity; // Updates quantity if product already exists
+        } else {
+            // Add new product to cart
+            lineOfProduct.insert(product, items.size());
+            items.push_back({product, quantity, unitPrice});
+            line = items.size() - 1;
+        }
+        quantityTotal += quantity;
+        priceTotal += items[line].unitPrice * quantity;
+        checkInvariants();
+    }
+
+    // Remove a product from the cart
+    void removeItem(ProductHandle product) {
+        uint32_t line;
+        if (!lineOfProduct.find(product, &line)) return;
+        quantityTotal -= items[line].quantity;
+        priceTotal -= items[line].subtotal();
+        lineOfProduct.erase(product);
+        items.erase(items.begin() + line);
+        for (size_t i = line; i < items.size(); ++i) {
+            lineOfProduct.set(items[i].product, i); // later lines moved up by one
+        }
+        checkInvariants();
+    }
+
+    // Remove every line the predicate accepts, keeping the order of the rest; returns how many went
+    template <typename Predicate>
+    size_t removeItemsIf(Predicate shouldRemove) {
+        size_t before = items.size();
+        items.erase(remove_if(items.begin(), items.end(), [&](const CartLine& item) {
+            if (!shouldRemove(item)) return false;
+            quantityTotal -= item.quantity;
+            priceTotal -= item.subtotal();
+            return true;
+        }), items.end());
+        if (items.size() != before) reindex();
+        checkInvariants();
+        return before - items.size();
+    }
+
+    // Update the quantity of a specific item in the cart
+    void updateQuantity(ProductHandle product, int newQuantity) {
+        uint32_t line;
+        if (lineOfProduct.find(product, &line)) {
+            quantityTotal += newQuantity - items[line].quantity;
+            priceTotal += items[line].unitPrice * (newQuantity - items[line].quantity);
+            items[line].quantity = newQuantity;
+            checkInvariants();
+        }
+    }
+
+    // Look up the quantity of a product in the cart
+    bool findItem(ProductHandle product, int* quantity) const {
+        uint32_t line;
+        if (!lineOfProduct.find(product, &line)) return false;
+        *quantity = items[line].quantity;
+        return true;
+    }
+
+    // Catalog version the unit prices come from
+    uint64_t pricedVersion() const {
+        return priceVersion;
+    }
+
+    // Take the unit prices from a newer catalog version (after an admin price change)
+    void reprice(const Catalog& catalog, uint64_t version) {
+        priceTotal = Money();
+        for (auto& item : items) {
+            item.unitPrice = catalog.price(item.product);
+            priceTotal += item.subtotal();
+        }
+        priceVersion = version;
+        checkInvariants();
+    }
+
+    // View the contents of the cart
+    void viewCart(const Catalog& catalog) const {
+        if (items.empty()) {
+            cout << "\nYour cart is empty." << endl;
+            return;
+        }
+        cout << "\nItems in your cart:\n" << string(30, '-') << endl;
+        for (int i = items.size() - 1; i >= 0; --i) {
+            ProductHandle product = items[i].product;
+            cout << catalog.id(product) << " - " << catalog.name(product)
+                 << (catalog.isRetired(product) ? " (no longer available)" : "")
+                 << " - Quantity: " << items[i].quantity
+                 << " - Item Price: Php. " << items[i].unitPrice
+                 << " - Subtotal: Php. " << items[i].subtotal() << endl;
+        }
+        cout << string(30, '-') << endl;
+        cout << "Total items in cart: " << totalItems() << endl;
+        cout << "Total Price: Php. " << totalPrice() << endl;
+    }
+
+    // Get the total number of items in the cart
+    int totalItems() const {
+        return quantityTotal;
+    }
+
+    // Get the total price of the cart
+    Money totalPrice() const {
+        return priceTotal;
+    }
+
+    // Read-only view of the cart lines, oldest first
+    const vector<CartLine>& lines() const {
+        return items;
+    }
+
+    // Clear the cart
+    void clearCart() {
+        items.clear();
+        lineOfProduct.clear();
+        quantityTotal = 0;
+        priceTotal = Money();
+    }
+
+    // Check if the cart is empty
+    bool isEmpty() const {
+        return items.empty();
+    }
+};
+
+// Class representing a user
+class User {
+public:
+    string email;
+    string password;
+    vector<Order> purchaseHistory;     // read through orders(), which decodes a restored history first
+    shared_ptr<LazyHistory> storedHistory; // set when restored from a snapshot
+    ShoppingCart userCart;
+    bool isAdmin = false; // can manage the product catalog
+
+    // Constructor to initialize a user
+    User(string email = "", string password = "") : email(email), password(password) {}
+
+    // The user's orders, oldest first
+    vector<Order>& orders() {
+        if (storedHistory) storedHistory->decodeInto(&purchaseHistory);
+        return purchaseHistory;
+    }
+
+    // Add an order to the user's purchase history
+    void addOrder(const Order& order) {
+        orders().push_back(order);
+    }
+};
+
+// User accounts kept in fixed-size chunks, so a User* stays valid while accounts are added,
+// with an open-addressing index from the email's hash to the user's number.
+class UserStore {
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    static constexpr size_t CHUNK_SIZE = 4096;
+    vector<vector<User>> chunks; // each reserved to CHUNK_SIZE and never grown past it
+    vector<uint64_t> hashes;
+    vector<uint32_t> slots;      // user number, EMPTY marks a free slot
+    size_t count = 0;
+    int shift = 64;
+
+    size_t slotFor(uint64_t emailHash) const {
+        return size_t((emailHash * 0x9E3779B97F4A7C15ull) >> shift);
+    }
+
+    void placeInIndex(uint64_t emailHash, uint32_t user) {
+        size_t mask = slots.size() - 1;
+        size_t slot = slotFor(emailHash);
+        while (slots[slot] != EMPTY) slot = (slot + 1) & mask;
+        hashes[slot] = emailHash;
+        slots[slot] = user;
+    }
+
+    void growIndex() {
+        vector<uint64_t> oldHashes;
+        vector<uint32_t> oldSlots;
+        oldHashes.swap(hashes);
+        oldSlots.swap(slots);
+        size_t capacity = oldSlots.empty() ? 16 : oldSlots.size() * 2;
+        hashes.assign(capacity, 0);
+        slots.assign(capacity, EMPTY);
+        shift = 64 - __builtin_ctzll(capacity);
+        for (size_t i = 0; i < oldSlots.size(); ++i) {
+            if (oldSlots[i] != EMPTY) placeInIndex(oldHashes[i], oldSlots[i]);
+        }
+    }
+
+public:
+    UserStore() {}
+    UserStore(const UserStore&) = delete;
+    UserStore& operator=(const UserStore&) = delete;
+
+    static uint64_t hashEmail(string_view email) {
+        return hash<string_view>()(email);
+    }
+
+    size_t size() const { return count; }
+
+    User& at(size_t user) {
+        return chunks[user / CHUNK_SIZE][user % CHUNK_SIZE];
+    }
+
+    // Find an account by email, or null
+    User* find(string_view email) {
+        return find(email, hashEmail(email));
+    }
+
+    User* find(string_view email, uint64_t emailHash) {
+        if (count == 0) return nullptr;
+        size_t mask = slots.size() - 1;
+        for (size_t slot = slotFor(emailHash); slots[slot] != EMPTY; slot = (slot + 1) & mask) {
+            if (hashes[slot] == emailHash) {
+                User& user = at(slots[slot]);
+                if (user.email == email) return &user;
+            }
+        }
+        return nullptr;
+    }
+
+    // Add an account; returns null if the email is already taken
+    User* insert(const string& email, const string& password) {
+        return insert(email, password, hashEmail(email));
+    }
+
+    User* insert(const string& email, const string& password, uint64_t emailHash) {
+        if (find(email, emailHash)) return nullptr;
+        if ((count + 1) * 2 > slots.size()) growIndex(); // keep the load factor at most 1/2
+        if (chunks.empty() || chunks.back().size() == CHUNK_SIZE) {
+            chunks.emplace_back();
+            chunks.back().reserve(CHUNK_SIZE);
+        }
+        chunks.back().emplace_back(email, password);
+        placeInIndex(emailHash, uint32_t(count));
+        ++count;
+        return &chunks.back().back();
+    }
+};
+
+// Class for user authentication. Accounts are split over shards by email hash, each with its
+// own lock, so sessions working on different emails rarely touch the same lock. A User's
+// email and password never change after sign-up, so they are read without the lock.
+class Auth {
+private:
+    static constexpr size_t SHARD_COUNT = 64;
+
+    struct alignas(64) Shard { // one cache line per lock
+        shared_mutex lock;
+        UserStore users;
+    };
+
+    unique_ptr<Shard[]> shards{new Shard[SHARD_COUNT]};
+
+    Shard& shardFor(uint64_t emailHash) {
+        // Bits 32 and up pick the shard. Every email in a shard shares them, but the store's
+        // index multiplies the whole hash before taking its top bits, so they still spread out there.
+        return shards[(emailHash >> 32) % SHARD_COUNT];
+    }
+
+public:
+    // Constructor to initialize with a default user
+    Auth() {
+        addUser("alex_trisha@gmail.com", "inteprogfinals");
+        addUser("brokestore.admin@gmail.com", "adminfinals")->isAdmin = true;
+    }
+
+    // Check the sign-up rules for an email and password; touches no shared state
+    static bool validateAccount(string_view email, string_view password, string* errorMessage) {
+        if (email.find("@gmail.com") == string_view::npos) { // Checks for valid Gmail format
+            *errorMessage = "Invalid email format. It must be a valid gmail.";
+            return false;
+        }
+
+        if (password.length() < 8) {
+            *errorMessage = "Password must be at least 8 characters long.";
+            return false;
+        }
+        return true;
+    }
+
+    // Add an account that has already been validated; returns null if the email is taken.
+    // The existence check and the insert happen under one shard lock.
+    User* addUser(const string& email, const string& password) {
+        uint64_t emailHash = UserStore::hashEmail(email);
+        Shard& shard = shardFor(emailHash);
+        lock_guard<shared_mutex> guard(shard.lock);
+        return shard.users.insert(email, password, emailHash);
+    }
+
+      bool signUp(const string& email, const string& password, string* errorMessage) {
+        if (!validateAccount(email, password, errorMessage)) return false;
+
+        // Adds new user unless the email is taken
+        if (!addUser(email, password)) {
+            *errorMessage = "User already exists.";
+            return false;
+        }
+        return true;
+    }
+
+    // Logs in a user
+    User* logIn(const string& email, const string& password) {
+        User* user = findUserByEmail(email);
+        if (user && user->password == password) return user;
+        return nullptr;
+    }
+
+    // Finds a user by email
+    User* findUserByEmail(const string& email) {
+        uint64_t emailHash = UserStore::hashEmail(email);
+        Shard& shard = shardFor(emailHash);
+        shared_lock<shared_mutex> guard(shard.lock);
+        return shard.users.find(email, emailHash);
+    }
+
+    // Call visit(user) for every account, one shard at a time
+    template <typename Visitor>
+    void forEachUser(Visitor visit) {
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            shared_lock<shared_mutex> guard(shards[i].lock);
+            for (size_t user = 0; user < shards[i].users.size(); ++user) visit(shards[i].users.at(user));
+        }
+    }
+
+    // Number of accounts
+    size_t size() {
+        size_t total = 0;
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            shared_lock<shared_mutex> guard(shards[i].lock);
+            total += shards[i].users.size();
+        }
+        return total;
+    }
+};
+
+// Run work(i) for every i in [0, count), split into contiguous ranges over `threads` threads
+template <typename Function>
+void parallelFor(size_t count, unsigned threads, Function work) {
+    threads = unsigned(max<size_t>(1, min<size_t>(threads, count)));
+    if (threads == 1) {
+        for (size_t i = 0; i < count; ++i) work(i);
+        return;
+    }
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        size_t begin = count * t / threads, end = count * (t + 1) / threads;
+        workers.emplace_back([&work, begin, end] {
+            for (size_t i = begin; i < end; ++i) work(i);
+        });
+    }
+    for (auto& worker : workers) worker.join();
+}
+
+// Counts from a bulk user import
+struct ImportSummary {
+    size_t rows = 0;
+    size_t imported = 0;
+    size_t rejected = 0;
+};
+
+// Import accounts from an "email,password" CSV (first line is a header). The file is read in
+// batches; each batch is parsed and validated in parallel, checked for emails repeated within
+// the batch, then inserted in parallel (the store rejects emails that already exist).
+// Rejected rows are written to rowErrors as "Line N: reason", in file order.
+bool importUsersCsv(Auth& auth, const string& csvPath, unsigned threads, ostream& rowErrors,
+                    ImportSummary* summary, string* errorMessage) {
+    ifstream in(csvPath);
+    if (!in) {
+        *errorMessage = "Cannot open " + csvPath + ".";
+        return false;
+    }
+
+    struct Row {
+        size_t lineNumber;
+        string line;
+        string email;
+        string password;
+        string error; // empty while the row is still accepted
+    };
+    const size_t batchSize = 1 << 16;
+    vector<Row> batch;
+    batch.reserve(batchSize);
+    unordered_map<string_view, size_t> firstLine; // email -> line that first used it in this batch
+    firstLine.reserve(batchSize);
+    string line;
+    size_t lineNumber = 0;
+    bool more = true;
+
+    while (more) {
+        batch.clear();
+        while (batch.size() < batchSize && (more = bool(getline(in, line)))) {
+            ++lineNumber;
+            if (lineNumber == 1 || line.empty() || line == "\r") continue; // skip header and blank lines
+            batch.push_back({lineNumber, move(line), string(), string(), string()});
+        }
+
+        parallelFor(batch.size(), threads, [&batch](size_t i) {
+            Row& row = batch[i];
+            if (!row.line.empty() && row.line.back() == '\r') row.line.pop_back();
+            vector<string> fields = parseCsvLine(row.line);
+            if (fields.size() != 2) {
+                row.error = "expected 2 fields.";
+                return;
+            }
+            row.email = move(fields[0]);
+            row.password = move(fields[1]);
+            Auth::validateAccount(row.email, row.password, &row.error);
+        });
+
+        firstLine.clear();
+        for (Row& row : batch) {
+            if (!row.error.empty()) continue;
+            auto inserted = firstLine.emplace(row.email, row.lineNumber);
+            if (!inserted.second) row.error = "Duplicate of line " + to_string(inserted.first->second) + ".";
+        }
+
+        parallelFor(batch.size(), threads, [&batch, &auth](size_t i) {
+            Row& row = batch[i];
+            if (row.error.empty() && !auth.addUser(row.email, row.password)) row.error = "User already exists.";
+        });
+
+        for (const Row& row : batch) {
+            ++summary->rows;
+            if (row.error.empty()) {
+                ++summary->imported;
+            } else {
+                ++summary->rejected;
+                rowErrors << "Line " << row.lineNumber << ": " << row.error << "\n";
+            }
+        }
+    }
+    return true;
+}
+
+// Seconds on a monotonic clock, for session expiry
+inline uint64_t monotonicSeconds() {
+    return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Logged-in sessions, keyed by an opaque token from the operating system's secure random
+// source, so seeing other tokens says nothing about the next one. A token maps to its session slot through
+// a FlatIndexMap, so opening, resuming and closing a session are constant time. Expiry is driven
+// by a timer wheel of one-second buckets: each session sits in the bucket of its expiry second,
+// and only the buckets that came due are visited. A resume pushes the expiry out without moving
+// the session; the wheel re-files it when its old bucket comes round.
+class SessionTable {
+public:
+    typedef uint64_t Token;
+
+private:
+    static constexpr size_t WHEEL_SIZE = 256; // buckets, one second each
+
+    struct Session {
+        Token token = 0;
+        User* user = nullptr; // null once closed or expired
+        uint64_t expiresAt = 0;
+    };
+
+    mutex lock;
+    uint64_t ttlSeconds;
+    vector<Session> sessions;
+    vector<uint32_t> freeSlots;    // closed slots are only reused after the wheel has dropped them
+    FlatIndexMap slotOfToken;
+    vector<uint32_t> wheel[WHEEL_SIZE];
+    vector<uint32_t> dueSlots;     // scratch for the bucket being processed
+    uint64_t wheelTime = 0;        // next second whose bucket has not been processed
+#ifndef _WIN32
+    int randomSource = ::open("/dev/urandom", O_RDONLY);
+#endif
+
+    bool secureRandom(Token* token) {
+#ifdef _WIN32
+        unsigned int high, low;
+        if (rand_s(&high) != 0 || rand_s(&low) != 0) return false;
+        *token = uint64_t(high) << 32 | low;
+        return true;
+#else
+        return randomSource >= 0 && ::read(randomSource, token, sizeof(*token)) == ssize_t(sizeof(*token));
+#endif
+    }
+
+    // Expire everything due at or before `now`
+    void advance(uint64_t now) {
+        if (wheelTime == 0) wheelTime = now;
+        // After a long idle gap one pass over the wheel visits every session
+        uint64_t last = min(now, wheelTime + WHEEL_SIZE - 1);
+        for (; wheelTime <= last; ++wheelTime) {
+            dueSlots.swap(wheel[wheelTime % WHEEL_SIZE]);
+            for (uint32_t slot : dueSlots) {
+                Session& session = sessions[slot];
+                if (session.user && session.expiresAt > now) {
+                    wheel[session.expiresAt % WHEEL_SIZE].push_back(slot); // resumed since, or a later lap
+                    continue;
+                }
+                if (session.user) slotOfToken.erase(session.token);
+                session.user = nullptr;
+                freeSlots.push_back(slot);
+            }
+            dueSlots.clear();
+        }
+        wheelTime = max(wheelTime, now + 1);
+    }
+
+public:
+    SessionTable(uint64_t ttlSeconds = 30 * 60) : ttlSeconds(ttlSeconds) {}
+    SessionTable(const SessionTable&) = delete;
+    SessionTable& operator=(const SessionTable&) = delete;
+
+    ~SessionTable() {
+#ifndef _WIN32
+        if (randomSource >= 0) ::close(randomSource);
+#endif
+    }
+
+    uint64_t ttl() const { return ttlSeconds; }
+
+    // Start a session for a user and return its token, or 0 if no secure token could be made
+    Token open(User* user, uint64_t now) {
+        lock_guard<mutex> guard(lock);
+        advance(now);
+        Token token;
+        uint32_t existing;
+        do {
+            if (!secureRandom(&token)) return 0;
+        } while (token == 0 || slotOfToken.find(token, &existing));
+
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            slot = sessions.size();
+            sessions.emplace_back();
+        }
+        sessions[slot].token = token;
+        sessions[slot].user = user;
+        sessions[slot].expiresAt = now + ttlSeconds;
+        slotOfToken.insert(token, slot);
+        wheel[sessions[slot].expiresAt % WHEEL_SIZE].push_back(slot);
+        return token;
+    }
+
+    // The user of a live session, or null if the token is unknown or expired; renews the session
+    User* resume(Token token, uint64_t now) {
+        lock_guard<mutex> guard(lock);
+        advance(now);
+        uint32_t slot;
+        if (!slotOfToken.find(token, &slot)) return nullptr;
+        sessions[slot].expiresAt = now + ttlSeconds;
+        return sessions[slot].user;
+    }
+
+    // End a session; its slot is recycled when the wheel reaches it
+    void close(Token token) {
+        lock_guard<mutex> guard(lock);
+        uint32_t slot;
+        if (!slotOfToken.find(token, &slot)) return;
+        slotOfToken.erase(token);
+        sessions[slot].user = nullptr;
+    }
+
+    // Number of live sessions
+    size_t size() {
+        lock_guard<mutex> guard(lock);
+        return slotOfToken.size();
+    }
+
+    static string formatToken(Token token) {
+        char text[17];
+        snprintf(text, sizeof(text), "%016llx", (unsigned long long)token);
+        return text;
+    }
+
+    static bool parseToken(const string& text, Token* token) {
+        if (text.empty() || text.length() > 16) return false;
+        *token = 0;
+        for (char c : text) {
+            int digit = isdigit((unsigned char)c) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                      : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+            if (digit < 0) return false;
+            *token = *token << 4 | digit;
+        }
+        return true;
+    }
+};
+
+// Store snapshot file: users, their saved carts and purchase histories at one point in time.
+// [SnapshotHeader][directory: skipped journal offsets, then one entry per user][history blobs]
+// A directory entry holds the email, password, admin flag, cart lines (packed product ID and
+// quantity) and where the user's encoded orders sit among the history blobs, with their CRC.
+// The directory is read at startup; each history blob is only decoded when it is first needed.
+// The header names the order journal the snapshot was taken against and the offset in it from
+// which orders are not in the snapshot, so only those are replayed on top; the journal offsets
+// listed first in the directory are orders past that point the snapshot already holds.
+const char SNAPSHOT_MAGIC[8] = {'N', 'B', 'S', 'N', 'A', 'P', '1', '\0'};
+const uint32_t SNAPSHOT_VERSION = 2;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t userCount;
+    uint64_t journalId;
+    uint64_t journalOffset;
+    uint64_t directorySize;
+    uint32_t directoryChecksum;
+    uint32_t appliedCount;      // journal offsets at the start of the directory
+};
+
+static_assert(sizeof(SnapshotHeader) == 48, "snapshot header layout changed");
+
+// Version 1 header: no journal ID and no skipped offsets
+struct SnapshotHeaderV1 {
+    char magic[8];
+    uint32_t version;
+    uint32_t userCount;
+    uint64_t journalOffset;
+    uint64_t directorySize;
+    uint32_t directoryChecksum;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SnapshotHeaderV1) == 40, "snapshot header layout changed");
+
+// Encode every account. Histories that were restored and never decoded are copied as they are.
+string encodeStoreSnapshot(Auth& auth, const Catalog& catalog, const JournalPosition& journal) {
+    string directory, histories;
+    uint32_t userCount = 0;
+    for (uint64_t offset : journal.alreadyApplied) appendValue<uint64_t>(&directory, offset);
+    auth.forEachUser([&](User& user) {
+        ++userCount;
+        appendString(&directory, user.email);
+        appendString(&directory, user.password);
+        appendValue<uint8_t>(&directory, user.isAdmin ? 1 : 0);
+        const vector<CartLine>& lines = user.userCart.lines();
+        appendValue<uint32_t>(&directory, lines.size());
+        for (const CartLine& line : lines) {
+            appendValue<uint64_t>(&directory, catalog.packedId(line.product));
+            appendValue<int32_t>(&directory, line.quantity);
+        }
+
+        size_t historyStart = histories.size();
+        string_view stored;
+        uint32_t orderCount;
+        if (user.storedHistory && user.storedHistory->pendingBlob(&stored, &orderCount)) {
+            histories.append(stored.data(), stored.size());
+        } else {
+            orderCount = user.purchaseHistory.size();
+            for (const Order& order : user.purchaseHistory) appendOrder(&histories, order, catalog);
+        }
+        appendValue<uint64_t>(&directory, historyStart);
+        appendValue<uint64_t>(&directory, histories.size() - historyStart);
+        appendValue<uint32_t>(&directory, crc32(histories.data() + historyStart, histories.size() - historyStart));
+        appendValue<uint32_t>(&directory, orderCount);
+    });
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.userCount = userCount;
+    header.journalId = journal.journalId;
+    header.journalOffset = journal.offset;
+    header.directorySize = directory.size();
+    header.directoryChecksum = crc32(directory.data(), directory.size());
+    header.appliedCount = journal.alreadyApplied.size();
+
+    string image(reinterpret_cast<const char*>(&header), sizeof(header));
+    image += directory;
+    image += histories;
+    return image;
+}
+
+// Load the accounts and carts from a snapshot (existing accounts with the same email are
+// overwritten) and attach each purchase history for decoding on first use; *restored is the
+// file the histories are decoded from, which counts the damaged ones
+bool restoreStoreSnapshot(const string& path, Auth& auth, const Catalog& catalog, JournalPosition* journal,
+                          size_t* userCount, shared_ptr<SnapshotSource>* restored, string* errorMessage) {
+    shared_ptr<SnapshotSource> source = make_shared<SnapshotSource>();
+    if (!source->file.open(path, errorMessage)) return false;
+    const char* data = source->file.bytes();
+    size_t length = source->file.size();
+
+    SnapshotHeader header = {};
+    size_t headerSize = sizeof(header);
+    if (length >= sizeof(SnapshotHeaderV1)) memcpy(&header, data, min(length, sizeof(header)));
+    if (length >= sizeof(SnapshotHeaderV1) && header.version == 1) {
+        SnapshotHeaderV1 old;
+        memcpy(&old, data, sizeof(old));
+        header.journalId = 0; // journals of that time had no ID either
+        header.journalOffset = old.journalOffset;
+        header.directorySize = old.directorySize;
+        header.directoryChecksum = old.directoryChecksum;
+        header.appliedCount = 0;
+        headerSize = sizeof(old);
+    } else if (length < sizeof(header)) {
+        *errorMessage = "Snapshot file is too small.";
+        return false;
+    }
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        (header.version != SNAPSHOT_VERSION && header.version != 1)) {
+        *errorMessage = "Not a supported snapshot file.";
+        return false;
+    }
+    if (header.directorySize > length - headerSize ||
+        crc32(data + headerSize, header.directorySize) != header.directoryChecksum) {
+        *errorMessage = "Snapshot directory is damaged.";
+        return false;
+    }
+    const char* histories = data + headerSize + header.directorySize;
+    size_t historiesSize = length - headerSize - header.directorySize;
+    source->handleOfId = handlesById(catalog);
+
+    RecordReader reader(string_view(data + headerSize, header.directorySize));
+    if (header.appliedCount > header.directorySize / sizeof(uint64_t)) {
+        *errorMessage = "Snapshot directory is truncated.";
+        return false;
+    }
+    vector<uint64_t> alreadyApplied(header.appliedCount);
+    for (uint64_t& offset : alreadyApplied) {
+        if (!reader.read(&offset)) {
+            *errorMessage = "Snapshot directory is truncated.";
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header.userCount; ++i) {
+        string email, password;
+        uint8_t admin;
+        uint32_t lineCount;
+        if (!reader.readString(&email) || !reader.readString(&password) || !reader.read(&admin) ||
+            !reader.read(&lineCount)) {
+            *errorMessage = "Snapshot directory is truncated.";
+            return false;
+        }
+        User* user = auth.addUser(email, password);
+        if (!user) user = auth.findUserByEmail(email); // a built-in account
+        user->password = password;
+        user->isAdmin = admin != 0;
+        user->userCart.clearCart();
+        for (uint32_t line = 0; line < lineCount; ++line) {
+            uint64_t packedId;
+            int32_t quantity;
+            if (!reader.read(&packedId) || !reader.read(&quantity)) {
+                *errorMessage = "Snapshot directory is truncated.";
+                return false;
+            }
+            // The writer only saves positive quantities, one line per product, so anything else
+            // means the directory is corrupt even though its checksum matched
+            ProductHandle product;
+            int existing;
+            if (quantity <= 0) {
+                *errorMessage = "Snapshot directory is damaged.";
+                return false;
+            }
+            if (!source->handleOfId.find(packedId, &product)) continue;
+            if (user->userCart.findItem(product, &existing)) {
+                *errorMessage = "Snapshot directory is damaged.";
+                return false;
+            }
+            user->userCart.addItem(product, quantity, catalog.price(product));
+        }
+
+        uint64_t historyOffset, historySize;
+        uint32_t historyChecksum, orderCount;
+        if (!reader.read(&historyOffset) || !reader.read(&historySize) || !reader.read(&historyChecksum) ||
+            !reader.read(&orderCount)) {
+            *errorMessage = "Snapshot directory is truncated.";
+            return false;
+        }
+        if (historyOffset > historiesSize || historySize > historiesSize - historyOffset) {
+            *errorMessage = "Snapshot history of " + email + " is out of range.";
+            return false;
+        }
+        user->purchaseHistory.clear();
+        user->storedHistory.reset();
+        if (orderCount > 0) {
+            user->storedHistory = make_shared<LazyHistory>(
+                source, string_view(histories + historyOffset, historySize), orderCount, historyChecksum);
+        }
+    }
+    journal->journalId = header.journalId;
+    journal->offset = header.journalOffset;
+    journal->alreadyApplied = move(alreadyApplied);
+    *userCount = header.userCount;
+    *restored = source;
+    return true;
+}
+
+// Writes store snapshots on a background thread. A request only wakes the writer, which then
+// captures the state through `capture` (on its own thread, so the caller never pays for the
+// encoding) and writes it; requests that arrive while one is being written are served by a
+// single capture afterwards. A failed write is kept for the foreground to pick up with
+// takeFailure instead of being printed from the writer's thread.
+class SnapshotWriter {
+private:
+    string path;
+    function<string()> capture;
+    mutex lock;
+    condition_variable wake;
+    condition_variable idle;
+    bool requested = false;
+    bool writing = false;
+    bool stopping = false;
+    string failure; // the last write's error, until taken
+    thread worker;
+
+    void writerLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return stopping || requested; });
+            if (!requested) break;
+            requested = false;
+            writing = true;
+            guard.unlock();
+            string errorMessage;
+            bool saved = replaceFileDurably(path, capture(), &errorMessage);
+            guard.lock();
+            if (!saved) failure = errorMessage;
+            writing = false;
+            idle.notify_all();
+        }
+    }
+
+public:
+    SnapshotWriter(const string& path, function<string()> capture)
+        : path(path), capture(move(capture)), worker([this] { writerLoop(); }) {}
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // Writes whatever is still requested before returning
+    ~SnapshotWriter() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    void request() {
+        {
+            lock_guard<mutex> guard(lock);
+            requested = true;
+        }
+        wake.notify_one();
+    }
+
+    // Wait until every requested snapshot is on disk
+    void flush() {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [this] { return !requested && !writing; });
+    }
+
+    // Why the last snapshot could not be written, once; false if nothing failed since the last call
+    bool takeFailure(string* errorMessage) {
+        lock_guard<mutex> guard(lock);
+        if (failure.empty()) return false;
+        errorMessage->swap(failure);
+        failure.clear();
+        return true;
+    }
+};
+
+// Runs callbacks at given times on one background thread. Callbacks should be short; ones
+// still waiting when the queue is destroyed are dropped.
+class TimerQueue {
+private:
+    struct Entry {
+        chrono::steady_clock::time_point due;
+        uint64_t order; // keeps callbacks due at the same time in scheduling order
+        function<void()> task;
+    };
+    struct Later {
+        bool operator()(const Entry& a, const Entry& b) const {
+            return a.due != b.due ? a.due > b.due : a.order > b.order;
+        }
+    };
+
+    mutex lock;
+    condition_variable wake;
+    priority_queue<Entry, vector<Entry>, Later> entries;
+    uint64_t nextOrder = 0;
+    bool stopping = false;
+    thread worker; // last, so everything above exists before it starts
+
+    void loop() {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            if (entries.empty()) {
+                wake.wait(guard);
+                continue;
+            }
+            chrono::steady_clock::time_point due = entries.top().due;
+            if (due > chrono::steady_clock::now()) {
+                wake.wait_until(guard, due);
+                continue;
+            }
+            Entry entry = entries.top();
+            entries.pop();
+            guard.unlock();
+            entry.task();
+            guard.lock();
+        }
+    }
+
+public:
+    TimerQueue() : worker([this] { loop(); }) {}
+    TimerQueue(const TimerQueue&) = delete;
+    TimerQueue& operator=(const TimerQueue&) = delete;
+
+    ~TimerQueue() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    void schedule(chrono::steady_clock::duration delay, function<void()> task) {
+        {
+            lock_guard<mutex> guard(lock);
+            entries.push({chrono::steady_clock::now() + delay, nextOrder++, move(task)});
+        }
+        wake.notify_one();
+    }
+};
+
+// One card payment to authorize
+struct PaymentRequest {
+    string reference; // the same on every retry, so the gateway never charges twice
+    string cardNumber;
+    string cardHolder;
+    string expiry;
+    string ccv;
+    Money amount;
+};
+
+struct PaymentReply {
+    enum Status { APPROVED, DECLINED, UNAVAILABLE };
+    Status status = UNAVAILABLE;
+    string authorizationCode;
+    string message;
+};
+
+// Something that authorizes payments and answers later, on a thread of its own
+class PaymentGateway {
+public:
+    using Callback = function<void(const PaymentReply&)>;
+    virtual void authorize(const PaymentRequest& request, Callback reply) = 0;
+    virtual ~PaymentGateway() {}
+};
+
+// Stands in for the card processor: every request is answered after a random delay (a fixed
+// minimum plus an exponential tail), and a configurable share of requests is refused as
+// busy, turned down, or never answered at all. Once a reference has been approved or
+// declined, asking again gets the same answer, the way real gateways handle retries; like
+// them it only remembers answers for a while (rememberFor), so memory stays bounded.
+class PaymentGatewaySimulator : public PaymentGateway {
+public:
+    struct Config {
+        chrono::microseconds minLatency{20000};
+        chrono::microseconds meanExtraLatency{30000};
+        double unavailableRate = 0.02; // answers "busy, try again"
+        double dropRate = 0.01;        // never answers
+        double declineRate = 0.0;      // the card is turned down
+        chrono::seconds rememberFor{24 * 60 * 60}; // how long a final answer is kept for retries
+    };
+
+private:
+    Config config;
+    mutex lock;
+    mt19937_64 random{random_device{}()};
+    unordered_map<string, PaymentReply> settled; // reference -> final answer
+    deque<pair<chrono::steady_clock::time_point, string>> settledOrder; // when each reference settled, oldest first
+    uint64_t nextAuthorization = 100000;
+    TimerQueue replies;
+
+    void settle(const string& reference, const PaymentReply& answer, chrono::steady_clock::time_point now) {
+        settled[reference] = answer;
+        settledOrder.push_back({now, reference});
+    }
+
+    // Forget answers older than rememberFor
+    void forgetExpired(chrono::steady_clock::time_point now) {
+        while (!settledOrder.empty() && now - settledOrder.front().first > config.rememberFor) {
+            settled.erase(settledOrder.front().second);
+            settledOrder.pop_front();
+        }
+    }
+
+public:
+    PaymentGatewaySimulator() : PaymentGatewaySimulator(Config()) {}
+    PaymentGatewaySimulator(const Config& config) : config(config) {}
+
+    void authorize(const PaymentRequest& request, Callback reply) override {
+        PaymentReply answer;
+        chrono::microseconds latency;
+        {
+            lock_guard<mutex> guard(lock);
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            forgetExpired(now);
+            exponential_distribution<double> extra(1.0 / max<int64_t>(config.meanExtraLatency.count(), 1));
+            latency = config.minLatency + chrono::microseconds(int64_t(extra(random)));
+            double roll = uniform_real_distribution<double>(0, 1)(random);
+            auto known = settled.find(request.reference);
+            if (known != settled.end()) {
+                answer = known->second;
+            } else if (roll < config.dropRate) {
+                return;
+            } else if (roll < config.dropRate + config.unavailableRate) {
+                answer = {PaymentReply::UNAVAILABLE, "", "The payment gateway is busy."};
+            } else if (roll < config.dropRate + config.unavailableRate + config.declineRate) {
+                answer = {PaymentReply::DECLINED, "", "The card was declined."};
+                settle(request.reference, answer, now);
+            } else {
+                answer = {PaymentReply::APPROVED, "A" + to_string(nextAuthorization++), ""};
+                settle(request.reference, answer, now);
+            }
+        }
+        replies.schedule(latency, [reply, answer] { reply(answer); });
+    }
+};
+
+// Asynchronous payment client. Each attempt gets a timeout; busy answers and timeouts are
+// retried with exponential backoff and jitter, and at most maxConcurrent attempts are out
+// at the gateway at once, the rest wait their turn. Callbacks run on the gateway's or the
+// client's timer thread. Destroy the client only once every call has been answered.
+class PaymentClient {
+public:
+    struct Config {
+        chrono::microseconds timeout{250000};
+        int maxAttempts = 3;
+        chrono::microseconds retryBackoff{50000}; // doubled after every attempt, then jittered
+        size_t maxConcurrent = 64;
+    };
+
+    struct Stats {
+        uint64_t attempts;
+        uint64_t retries;
+        uint64_t timeouts;
+        uint64_t approved;
+        uint64_t declined;
+        uint64_t failed;
+    };
+
+    using Callback = function<void(const PaymentReply&)>;
+
+private:
+    struct Call {
+        PaymentRequest request;
+        Callback done;
+        int attempt = 0;
+    };
+    struct Attempt {
+        shared_ptr<Call> call;
+        atomic<bool> settled{false}; // the reply and the timeout race; the first one wins
+    };
+
+    PaymentGateway& gateway;
+    Config config;
+    mutex lock;
+    deque<shared_ptr<Call>> waiting; // calls held back by the concurrency limit
+    size_t active = 0;
+    atomic<uint64_t> attempts{0}, retries{0}, timeouts{0}, approved{0}, declined{0}, failed{0};
+    TimerQueue timers; // timeouts and retry delays
+
+    void start(shared_ptr<Call> call) {
+        {
+            lock_guard<mutex> guard(lock);
+            if (active >= config.maxConcurrent) {
+                waiting.push_back(move(call));
+                return;
+            }
+            ++active;
+        }
+        send(move(call));
+    }
+
+    void send(shared_ptr<Call> call) {
+        ++call->attempt;
+        attempts.fetch_add(1, memory_order_relaxed);
+        shared_ptr<Attempt> attempt = make_shared<Attempt>();
+        attempt->call = call;
+        timers.schedule(config.timeout, [this, attempt] {
+            if (attempt->settled.exchange(true)) return;
+            timeouts.fetch_add(1, memory_order_relaxed);
+            settle(attempt->call, {PaymentReply::UNAVAILABLE, "", "The payment gateway did not answer in time."});
+        });
+        // A late reply only touches the attempt, so it is harmless after the client is gone
+        gateway.authorize(call->request, [this, attempt](const PaymentReply& reply) {
+            if (!attempt->settled.exchange(true)) settle(attempt->call, reply);
+        });
+    }
+
+    // One attempt is over: free its slot, then retry or report
+    void settle(shared_ptr<Call> call, const PaymentReply& reply) {
+        shared_ptr<Call> next;
+        {
+            lock_guard<mutex> guard(lock);
+            if (waiting.empty()) {
+                --active;
+            } else {
+                next = move(waiting.front());
+                waiting.pop_front();
+            }
+        }
+        if (next) send(move(next));
+
+        if (reply.status == PaymentReply::UNAVAILABLE && call->attempt < config.maxAttempts) {
+            retries.fetch_add(1, memory_order_relaxed);
+            timers.schedule(backoff(call->attempt), [this, call] { start(call); });
+            return;
+        }
+        if (reply.status == PaymentReply::APPROVED) approved.fetch_add(1, memory_order_relaxed);
+        else if (reply.status == PaymentReply::DECLINED) declined.fetch_add(1, memory_order_relaxed);
+        else failed.fetch_add(1, memory_order_relaxed);
+        call->done(reply);
+    }
+
+    // Half the doubled backoff plus a random part of the other half, so callers that failed
+    // together do not all come back together
+    chrono::microseconds backoff(int attempt) const {
+        thread_local mt19937_64 random{random_device{}()};
+        int64_t full = config.retryBackoff.count() << min(attempt - 1, 20);
+        return chrono::microseconds(full / 2 + int64_t(uniform_int_distribution<int64_t>(0, full / 2)(random)));
+    }
+
+public:
+    PaymentClient(PaymentGateway& gateway) : PaymentClient(gateway, Config()) {}
+    PaymentClient(PaymentGateway& gateway, const Config& config) : gateway(gateway), config(config) {
+        this->config.maxAttempts = max(1, config.maxAttempts);
+        this->config.maxConcurrent = max<size_t>(1, config.maxConcurrent);
+    }
+    PaymentClient(const PaymentClient&) = delete;
+    PaymentClient& operator=(const PaymentClient&) = delete;
+
+    // Authorize a payment; `done` gets the final answer
+    void authorize(PaymentRequest request, Callback done) {
+        shared_ptr<Call> call = make_shared<Call>();
+        call->request = move(request);
+        call->done = move(done);
+        start(move(call));
+    }
+
+    future<PaymentReply> authorize(PaymentRequest request) {
+        shared_ptr<promise<PaymentReply>> answer = make_shared<promise<PaymentReply>>();
+        future<PaymentReply> result = answer->get_future();
+        authorize(move(request), [answer](const PaymentReply& reply) { answer->set_value(reply); });
+        return result;
+    }
+
+    Stats stats() const {
+        return {attempts.load(), retries.load(), timeouts.load(), approved.load(), declined.load(), failed.load()};
+    }
+};
+
+// Character classes for the payment field checks, built at compile time
+struct DigitTable {
+    bool isDigit[256];
+    uint8_t luhnDoubled[10]; // a digit doubled, with the two digits of the result added up
+
+    constexpr DigitTable() : isDigit(), luhnDoubled() {
+        for (int c = '0'; c <= '9'; ++c) isDigit[c] = true;
+        for (int d = 0; d < 10; ++d) luhnDoubled[d] = uint8_t(d * 2 > 9 ? d * 2 - 9 : d * 2);
+    }
+};
+
+constexpr DigitTable DIGITS;
+
+inline bool isDigitChar(char c) {
+    return DIGITS.isDigit[(unsigned char)c];
+}
+
+// The payment fields of one checkout in one cache line, so a batch of them can be checked
+// with a couple of vector loads per record. Fields are zero padded; a field too long for
+// its slot keeps a length one past the slot, which no check accepts.
+struct alignas(64) PaymentFields {
+    static constexpr size_t CARD_OFFSET = 0, PHONE_OFFSET = 32, CCV_OFFSET = 48, EXPIRY_OFFSET = 52;
+
+    char cardNumber[32];
+    char phone[16];
+    char ccv[4];
+    char expiry[5];
+    uint8_t cardLength;
+    uint8_t phoneLength;
+    uint8_t ccvLength;
+    uint8_t expiryLength;
+
+    static uint8_t copyField(char* slot, size_t slotSize, string_view text) {
+        size_t length = min(text.size(), slotSize);
+        memcpy(slot, text.data(), length);
+        return uint8_t(text.size() > slotSize ? slotSize + 1 : text.size());
+    }
+
+    static PaymentFields from(string_view phone, string_view cardNumber, string_view ccv, string_view expiry) {
+        PaymentFields fields;
+        memset(&fields, 0, sizeof(fields));
+        fields.cardLength = copyField(fields.cardNumber, sizeof(fields.cardNumber), cardNumber);
+        fields.phoneLength = copyField(fields.phone, sizeof(fields.phone), phone);
+        fields.ccvLength = copyField(fields.ccv, sizeof(fields.ccv), ccv);
+        fields.expiryLength = copyField(fields.expiry, sizeof(fields.expiry), expiry);
+        return fields;
+    }
+};
+static_assert(sizeof(PaymentFields) == 64, "payment fields fill exactly one cache line");
+static_assert(offsetof(PaymentFields, phone) == PaymentFields::PHONE_OFFSET &&
+              offsetof(PaymentFields, ccv) == PaymentFields::CCV_OFFSET &&
+              offsetof(PaymentFields, expiry) == PaymentFields::EXPIRY_OFFSET,
+              "field offsets match the digit mask layout");
+
+// Digit mask kernels: bit i of a record's mask is set when byte i of the record is a digit
+typedef void (*PaymentDigitMaskFunction)(const PaymentFields* records, size_t count, uint64_t* masks);
+
+void paymentDigitMasksScalar(const PaymentFields* records, size_t count, uint64_t* masks) {
+    for (size_t r = 0; r < count; ++r) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&records[r]);
+        uint64_t mask = 0;
+        for (int i = 0; i < 64; ++i) mask |= uint64_t(DIGITS.isDigit[bytes[i]]) << i;
+        masks[r] = mask;
+    }
+}
+
+#ifdef BROKESTORE_X86_SIMD
+// '0' <= byte <= '9' for 16 bytes; bytes above 127 compare as negative and fail the first test
+__attribute__((target("sse2"))) inline unsigned digitMask128(const void* bytes) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+    return unsigned(_mm_movemask_epi8(digit));
+}
+
+__attribute__((target("sse2")))
+void paymentDigitMasksSse2(const PaymentFields* records, size_t count, uint64_t* masks) {
+    for (size_t r = 0; r < count; ++r) {
+        const char* bytes = reinterpret_cast<const char*>(&records[r]);
+        masks[r] = uint64_t(digitMask128(bytes)) | uint64_t(digitMask128(bytes + 16)) << 16 |
+                   uint64_t(digitMask128(bytes + 32)) << 32 | uint64_t(digitMask128(bytes + 48)) << 48;
+    }
+}
+
+__attribute__((target("avx2"))) inline uint32_t digitMask256(const void* bytes) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    return uint32_t(_mm256_movemask_epi8(digit));
+}
+
+__attribute__((target("avx2")))
+void paymentDigitMasksAvx2(const PaymentFields* records, size_t count, uint64_t* masks) {
+    for (size_t r = 0; r < count; ++r) {
+        const char* bytes = reinterpret_cast<const char*>(&records[r]);
+        masks[r] = uint64_t(digitMask256(bytes)) | uint64_t(digitMask256(bytes + 32)) << 32;
+    }
+}
+#endif
+
+PaymentDigitMaskFunction selectPaymentDigitMasks(const char** kernelName = nullptr) {
+#ifdef BROKESTORE_X86_SIMD
+    return pickKernel(paymentDigitMasksScalar, paymentDigitMasksSse2, paymentDigitMasksAvx2, kernelName);
+#else
+    return pickKernel(paymentDigitMasksScalar, kernelName);
+#endif
+}
+
+// Checks for the payment fields entered at checkout. Every check returns a set of problem
+// flags, zero meaning valid; describe() turns the first one into the message shown to the
+// buyer. Nothing allocates.
+class PaymentValidator {
+public:
+    enum Problem : uint8_t {
+        PHONE = 1 << 0,         // 8 to 15 digits
+        CARD_NUMBER = 1 << 1,   // 13 to 19 digits
+        CARD_CHECKSUM = 1 << 2, // fails the Luhn check
+        CCV = 1 << 3,           // 3 or 4 digits
+        EXPIRY_FORMAT = 1 << 4, // not MM/YY
+        EXPIRY_DIGITS = 1 << 5,
+        EXPIRY_MONTH = 1 << 6,
+        EXPIRED = 1 << 7,
+    };
+
+private:
+    static bool allDigits(string_view text) {
+        for (char c : text) {
+            if (!isDigitChar(c)) return false;
+        }
+        return true;
+    }
+
+    // Low `count` bits set, count <= 32
+    static uint64_t lowBits(unsigned count) {
+        return (uint64_t(1) << count) - 1;
+    }
+
+    // Month and year of an MM/YY whose four digits are already known to be digits
+    static uint8_t expiryDateProblems(const char* expiry) {
+        int month = (expiry[0] - '0') * 10 + (expiry[1] - '0');
+        int year = 2000 + (expiry[3] - '0') * 10 + (expiry[4] - '0');
+        if (month < 1 || month > 12) return EXPIRY_MONTH;
+        return year < currentYear() ? EXPIRED : 0;
+    }
+
+    static uint8_t lengthProblems(size_t phone, size_t card, size_t ccv, size_t expiry) {
+        uint8_t problems = 0;
+        if (phone < 8 || phone > 15) problems |= PHONE;
+        if (card < 13 || card > 19) problems |= CARD_NUMBER;
+        if (ccv < 3 || ccv > 4) problems |= CCV;
+        if (expiry != 5) problems |= EXPIRY_FORMAT;
+        return problems;
+    }
+
+public:
+    // The local year, looked up again only once the cached one has run out
+    static int currentYear() {
+        static atomic<int> year{0};
+        static atomic<int64_t> validUntil{0};
+        int64_t now = time(0);
+        if (now < validUntil.load(memory_order_acquire)) return year.load(memory_order_relaxed);
+
+        time_t clock = time_t(now);
+        tm local;
+#ifdef _WIN32
+        localtime_s(&local, &clock);
+#else
+        localtime_r(&clock, &local); // checkout workers validate in parallel
+#endif
+        tm nextYear = {};
+        nextYear.tm_year = local.tm_year + 1;
+        nextYear.tm_mday = 1;
+        nextYear.tm_isdst = -1;
+        year.store(1900 + local.tm_year, memory_order_relaxed);
+        validUntil.store(int64_t(mktime(&nextYear)), memory_order_release);
+        return 1900 + local.tm_year;
+    }
+
+    static bool luhnValid(string_view digits) {
+        unsigned sum = 0;
+        bool doubled = false;
+        for (size_t i = digits.size(); i-- > 0;) {
+            unsigned digit = unsigned(digits[i] - '0');
+            sum += doubled ? DIGITS.luhnDoubled[digit] : digit;
+            doubled = !doubled;
+        }
+        return sum % 10 == 0;
+    }
+
+    static uint8_t checkPhone(string_view phone) {
+        return phone.size() >= 8 && phone.size() <= 15 && allDigits(phone) ? 0 : PHONE;
+    }
+
+    static uint8_t checkCardNumber(string_view cardNumber) {
+        if (cardNumber.size() < 13 || cardNumber.size() > 19 || !allDigits(cardNumber)) return CARD_NUMBER;
+        return luhnValid(cardNumber) ? 0 : CARD_CHECKSUM;
+    }
+
+    static uint8_t checkCcv(string_view ccv) {
+        return (ccv.size() == 3 || ccv.size() == 4) && allDigits(ccv) ? 0 : CCV;
+    }
+
+    static uint8_t checkExpiry(string_view expiry) {
+        if (expiry.size() != 5 || expiry[2] != '/') return EXPIRY_FORMAT;
+        if (!isDigitChar(expiry[0]) || !isDigitChar(expiry[1]) || !isDigitChar(expiry[3]) || !isDigitChar(expiry[4]))
+            return EXPIRY_DIGITS;
+        return expiryDateProblems(expiry.data());
+    }
+
+    static uint8_t check(string_view phone, string_view cardNumber, string_view ccv, string_view expiry) {
+        return checkPhone(phone) | checkCardNumber(cardNumber) | checkCcv(ccv) | checkExpiry(expiry);
+    }
+
+    // Check many records at once; problems[i] gets the flags of records[i]. The digit tests
+    // of a record are one vector pass over its cache line; only Luhn and the expiry date are
+    // worked out field by field.
+    static void checkBatch(const PaymentFields* records, size_t count, uint8_t* problems) {
+        static const PaymentDigitMaskFunction digitMasks = selectPaymentDigitMasks();
+        const size_t CHUNK = 256;
+        uint64_t masks[CHUNK];
+        for (size_t start = 0; start < count; start += CHUNK) {
+            size_t chunk = min(CHUNK, count - start);
+            digitMasks(records + start, chunk, masks);
+            for (size_t i = 0; i < chunk; ++i) {
+                const PaymentFields& record = records[start + i];
+                uint64_t mask = masks[i];
+                uint8_t found = lengthProblems(record.phoneLength, record.cardLength, record.ccvLength, record.expiryLength);
+                if (!(found & PHONE)) {
+                    uint64_t need = lowBits(record.phoneLength) << PaymentFields::PHONE_OFFSET;
+                    if ((mask & need) != need) found |= PHONE;
+                }
+                if (!(found & CARD_NUMBER)) {
+                    uint64_t need = lowBits(record.cardLength) << PaymentFields::CARD_OFFSET;
+                    if ((mask & need) != need) found |= CARD_NUMBER;
+                    else if (!luhnValid(string_view(record.cardNumber, record.cardLength))) found |= CARD_CHECKSUM;
+                }
+                if (!(found & CCV)) {
+                    uint64_t need = lowBits(record.ccvLength) << PaymentFields::CCV_OFFSET;
+                    if ((mask & need) != need) found |= CCV;
+                }
+                if (!(found & EXPIRY_FORMAT)) {
+                    uint64_t need = uint64_t(0x1B) << PaymentFields::EXPIRY_OFFSET; // MM/YY without the '/'
+                    if (record.expiry[2] != '/') found |= EXPIRY_FORMAT;
+                    else if ((mask & need) != need) found |= EXPIRY_DIGITS;
+                    else found |= expiryDateProblems(record.expiry);
+                }
+                problems[start + i] = found;
+            }
+        }
+    }
+
+    // What to tell the buyer about the first problem found
+    static const char* describe(uint8_t problems) {
+        if (problems & PHONE) return "Invalid phone number. Please enter digits only, minimum 8 and maximum 15 characters.";
+        if (problems & CARD_NUMBER) return "Invalid card number. Please enter digits only, between 13 and 19 characters.";
+        if (problems & CARD_CHECKSUM) return "Invalid card number. Please check the digits and try again.";
+        if (problems & CCV) return "Invalid CCV. Please enter 3 or 4 digit number.";
+        if (problems & EXPIRY_FORMAT) return "Invalid format. Please enter in MM/YY format.";
+        if (problems & EXPIRY_DIGITS) return "Invalid numbers in expiration date.";
+        if (problems & EXPIRY_MONTH) return "Invalid month. Please enter a month between 01 and 12.";
+        if (problems & EXPIRED) return "Invalid expiration year. Please enter a valid year.";
+        return "";
+    }
+};
+
+// Everything the buyer entered at checkout. The cart lines are a copy, so the cart itself
+// can change while the order is being placed; the catalog must stay alive until the result
+// is ready, which catalogPin sees to when it comes from a CatalogStore.
+struct CheckoutRequest {
+    User* user = nullptr;
+    string idempotencyKey; // the same on a retry of the same checkout; empty to never match
+    const Catalog* catalog = nullptr;
+    shared_ptr<CatalogStore::Reader> catalogPin; // the version *catalog belongs to; empty if the caller owns it
+    vector<CartLine> lines;
+    string buyerName;
+    string buyerPhone;
+    string cardType; // "Debit card" or "Credit card"
+    string cardNumber;
+    string cardHolder;
+    string ccv;
+    string expiry; // MM/YY
+
+    // Names this checkout across retries: the buyer and their idempotency key
+    string retryKey() const {
+        return user->email + '\n' + idempotencyKey;
+    }
+};
+
+struct CheckoutResult {
+    bool placed = false;
+    bool repeated = false; // a retry, answered with the order its first attempt placed
+    bool chargeUncertain = false; // not placed, but the card may have been charged
+    string errorMessage;
+    Order order; // filled in stage by stage; complete once placed
+};
+
+// Receives a checkout's result, on whichever thread finished it
+using CheckoutCallback = function<void(CheckoutResult result)>;
+
+enum CheckoutStage { CHECKOUT_VALIDATE, CHECKOUT_PRICE, CHECKOUT_AUTHORIZE, CHECKOUT_PERSIST, CHECKOUT_DELIVER };
+constexpr int CHECKOUT_STAGE_COUNT = 5;
+constexpr const char* CHECKOUT_STAGE_NAMES[CHECKOUT_STAGE_COUNT] = {"validate", "price", "authorize", "persist", "deliver"};
+
+// What the checkout stages need from the store
+struct CheckoutServices {
+    OrderIdGenerator* orderIds = nullptr;
+    OrderJournal* journal = nullptr; // orders are only kept in memory while it is closed
+    PaymentClient* payments = nullptr; // without one every payment is approved
+    shared_mutex* accounts = nullptr; // held exclusively while an order joins a purchase history
+};
+
+// One checkout on its way through the stages
+struct CheckoutJob {
+    CheckoutRequest request;
+    CheckoutResult result;
+    CheckoutCallback done;
+    chrono::steady_clock::time_point queuedAt;
+    bool journaled = false;  // persist put the order in the journal at journalRecord
+    uint64_t journalRecord = 0;
+};
+
+// The checkout stages themselves. Each one returns false, with the reason in the job's
+// result, when the order cannot go on.
+class CheckoutProcessor {
+private:
+    CheckoutServices services;
+    shared_mutex ownAccountsLock; // used when the services bring none; purchase histories are plain vectors
+
+    shared_mutex& accountsLock() {
+        return services.accounts ? *services.accounts : ownAccountsLock;
+    }
+
+    bool validate(CheckoutJob& job) {
+        const CheckoutRequest& request = job.request;
+        return validate(job, PaymentValidator::check(request.buyerPhone, request.cardNumber, request.ccv, request.expiry));
+    }
+
+    // Charge the catalog's current prices, which the cart has already been repriced to
+    bool price(CheckoutJob& job) {
+        Order& order = job.result.order;
+        order.purchasedItems.reserve(job.request.lines.size());
+        order.totalPrice = Money();
+        order.totalQuantity = 0;
+        for (const CartLine& line : job.request.lines) {
+            Money unitPrice = job.request.catalog->price(line.product);
+            order.purchasedItems.push_back({line.product, line.quantity, unitPrice});
+            order.totalPrice += unitPrice * line.quantity;
+            order.totalQuantity += line.quantity;
+        }
+        order.buyerName = job.request.buyerName;
+        order.buyerPhone = job.request.buyerPhone;
+        return true;
+    }
+
+    // The payment's reference comes from the checkout's retry key, so a retry of a checkout
+    // whose payment went through is answered with that payment instead of charging again;
+    // only checkouts without a key use their new order number
+    PaymentRequest preparePayment(CheckoutJob& job) {
+        const CheckoutRequest& request = job.request;
+        Order& order = job.result.order;
+        order.orderNumber = services.orderIds->next();
+        order.paymentMethod = request.cardType + " ending in " +
+                              request.cardNumber.substr(request.cardNumber.size() >= 4 ? request.cardNumber.size() - 4 : 0);
+        string reference = request.idempotencyKey.empty() ? to_string(order.orderNumber) : request.retryKey();
+        return {move(reference), request.cardNumber, request.cardHolder, request.expiry, request.ccv, order.totalPrice};
+    }
+
+    bool applyPayment(CheckoutJob& job, const PaymentReply& reply) {
+        if (reply.status == PaymentReply::APPROVED) return true;
+        if (reply.status == PaymentReply::DECLINED) {
+            job.result.errorMessage = "Your payment was declined: " + reply.message;
+            return false;
+        }
+        // An attempt that timed out may still have been approved
+        job.result.chargeUncertain = true;
+        job.result.errorMessage = "Your payment could not be completed: " + reply.message +
+                                  " It may still have gone through; check with your card issuer before ordering again.";
+        return false;
+    }
+
+    bool authorize(CheckoutJob& job) {
+        PaymentRequest payment = preparePayment(job);
+        if (!services.payments) return true;
+        return applyPayment(job, services.payments->authorize(move(payment)).get());
+    }
+
+    // Make the order durable before anyone is told it was placed
+    bool persist(CheckoutJob& job) {
+        Order& order = job.result.order;
+        order.orderTime = time(0);
+        if (!services.journal || !services.journal->isOpen()) return true;
+        string errorMessage;
+        if (!services.journal->commit(encodeOrderRecord(job.request.user->email, order, *job.request.catalog),
+                                      &job.journalRecord, &errorMessage)) {
+            services.journal->markApplied(job.journalRecord);
+            job.result.chargeUncertain = true; // the payment was approved
+            job.result.errorMessage = "Your order could not be saved (" + errorMessage + "), but your card was charged.";
+            return false;
+        }
+        job.journaled = true;
+        return true;
+    }
+
+    // The order joins the history and is marked applied in the journal together, so a snapshot
+    // sees both or neither
+    bool deliver(CheckoutJob& job) {
+        {
+            lock_guard<shared_mutex> guard(accountsLock());
+            job.request.user->addOrder(job.result.order);
+            if (job.journaled) services.journal->markApplied(job.journalRecord);
+        }
+        job.result.placed = true;
+        return true;
+    }
+
+public:
+    CheckoutProcessor(const CheckoutServices& services) : services(services) {}
+
+    // The cart checks; the payment fields were already checked, possibly in a batch
+    bool validate(CheckoutJob& job, uint8_t paymentProblems) {
+        const CheckoutRequest& request = job.request;
+        string& errorMessage = job.result.errorMessage;
+        if (!request.user || !request.catalog) {
+            errorMessage = "No user is logged in.";
+            return false;
+        }
+        if (request.lines.empty()) {
+            errorMessage = "Your cart is empty.";
+            return false;
+        }
+        for (const CartLine& line : request.lines) {
+            if (line.quantity <= 0 || line.product >= request.catalog->size()) {
+                errorMessage = "Your cart has an invalid item.";
+                return false;
+            }
+            if (request.catalog->isRetired(line.product)) {
+                errorMessage = string(request.catalog->name(line.product)) + " is no longer available.";
+                return false;
+            }
+        }
+        if (paymentProblems) {
+            errorMessage = PaymentValidator::describe(paymentProblems);
+            return false;
+        }
+        return true;
+    }
+
+    // Whether authorizing waits on a payment gateway; if so, use authorizeAsync
+    bool paysAsynchronously() const {
+        return services.payments != nullptr;
+    }
+
+    // The authorize stage without waiting for the gateway; `resume` gets the outcome on the
+    // payment client's thread
+    void authorizeAsync(CheckoutJob& job, function<void(bool passed)> resume) {
+        PaymentRequest payment = preparePayment(job);
+        services.payments->authorize(move(payment), [this, &job, resume](const PaymentReply& reply) {
+            resume(applyPayment(job, reply));
+        });
+    }
+
+    bool run(CheckoutStage stage, CheckoutJob& job) {
+        switch (stage) {
+        case CHECKOUT_VALIDATE: return validate(job);
+        case CHECKOUT_PRICE: return price(job);
+        case CHECKOUT_AUTHORIZE: return authorize(job);
+        case CHECKOUT_PERSIST: return persist(job);
+        case CHECKOUT_DELIVER: return deliver(job);
+        }
+        return false;
+    }
+};
+
+// Abstract class for checkout strategy
+class CheckoutStrategy {
+public:
+    // Place an order; `done` is called once it has been placed or turned down
+    virtual void submit(CheckoutRequest request, CheckoutCallback done) = 0;
+
+    // The same, with a future that is ready once the order has been placed or turned down
+    future<CheckoutResult> submit(CheckoutRequest request) {
+        shared_ptr<promise<CheckoutResult>> done = make_shared<promise<CheckoutResult>>();
+        future<CheckoutResult> result = done->get_future();
+        submit(move(request), [done](CheckoutResult outcome) { done->set_value(move(outcome)); });
+        return result;
+    }
+
+    virtual ~CheckoutStrategy() {}
+};
+
+// Standard checkout implementation: every stage in turn, on the caller's thread
+class StandardCheckout : public CheckoutStrategy {
+private:
+    CheckoutProcessor processor;
+
+public:
+    StandardCheckout(const CheckoutServices& services) : processor(services) {}
+
+    using CheckoutStrategy::submit;
+
+    void submit(CheckoutRequest request, CheckoutCallback done) override {
+        CheckoutJob job;
+        job.request = move(request);
+        for (int stage = 0; stage < CHECKOUT_STAGE_COUNT; ++stage) {
+            if (!processor.run(CheckoutStage(stage), job)) break;
+        }
+        done(move(job.result));
+    }
+};
+
+// Bounded multi-producer, multi-consumer queue. Every cell carries a sequence number telling
+// whether it is ready to be written or read, so a push or a pop is a single compare-and-swap
+// on the tail or head and never takes a lock.
+template <typename T>
+class BoundedQueue {
+private:
+    struct alignas(64) Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> tail{0}; // next position to push
+    alignas(64) atomic<size_t> head{0}; // next position to pop
+
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // False when the queue is full
+    bool tryPush(T value) {
+        size_t position = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t difference = intptr_t(sequence) - intptr_t(position);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    cell.value = move(value);
+                    cell.sequence.store(position + 1, memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // False when the queue is empty
+    bool tryPop(T* value) {
+        size_t position = head.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(memory_order_acquire);
+            intptr_t difference = intptr_t(sequence) - intptr_t(position + 1);
+            if (difference == 0) {
+                if (head.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    *value = move(cell.value);
+                    cell.sequence.store(position + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = head.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Approximate while other threads are pushing or popping
+    size_t depth() const {
+        size_t pushed = tail.load(memory_order_relaxed);
+        size_t popped = head.load(memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+    }
+
+    size_t capacity() const { return mask + 1; }
+};
+
+// How one pipeline stage is doing. Wait is the time a checkout spent queued for the stage,
+// service the time the stage took.
+struct CheckoutStageStats {
+    const char* name;
+    size_t queueDepth;
+    uint64_t processed;
+    double averageWaitMicroseconds;
+    double averageServiceMicroseconds;
+    double maxServiceMicroseconds;
+};
+
+// Pipelined checkout: each stage has a bounded queue in front of it and a shared pool of
+// workers moves checkouts from queue to queue, so many checkouts are in flight at once and
+// the persist stage's journal commits share fsyncs. Workers look at the later stages first,
+// which finishes orders already under way before new ones are started. When the next queue
+// is full the worker runs the next stage itself instead of waiting for room. A worker that
+// picks up a checkout to validate takes up to 31 more waiting ones and checks all their
+// payment fields in one batch. With a payment
+// client, checkouts wait for the gateway outside the pipeline, so the number of payments
+// in flight is limited by the client and not by the number of workers.
+class PipelinedCheckout : public CheckoutStrategy {
+public:
+    struct Config {
+        size_t queueCapacity = 1024;
+        unsigned workers = 4; // more than the cores: persist workers mostly wait for the disk
+    };
+
+private:
+    struct alignas(64) StageCounters {
+        atomic<uint64_t> processed{0};
+        atomic<uint64_t> waitNanoseconds{0};
+        atomic<uint64_t> serviceNanoseconds{0};
+        atomic<uint64_t> maxServiceNanoseconds{0};
+    };
+
+    CheckoutProcessor processor;
+    array<unique_ptr<BoundedQueue<CheckoutJob*>>, CHECKOUT_STAGE_COUNT> queues;
+    array<StageCounters, CHECKOUT_STAGE_COUNT> counters;
+    atomic<size_t> queued{0};   // checkouts sitting in a queue
+    atomic<size_t> inFlight{0}; // checkouts submitted and not finished
+    atomic<unsigned> sleepers{0};
+    atomic<unsigned> paymentCallbacks{0}; // payment replies being handed back in right now
+    atomic<bool> stopping{false};
+    mutex idleLock;
+    condition_variable idle;
+    vector<thread> workers;
+
+    // Wake sleeping workers; taking the lock keeps a worker from missing the news
+    // between checking for work and going to sleep
+    void wake(bool everyone) {
+        { lock_guard<mutex> guard(idleLock); }
+        if (everyone) idle.notify_all();
+        else idle.notify_one();
+    }
+
+    void enqueue(CheckoutJob* job, int stage) {
+        job->queuedAt = chrono::steady_clock::now();
+        while (!queues[stage]->tryPush(job)) this_thread::yield(); // only submit waits for room
+        queued.fetch_add(1);
+        if (sleepers.load() > 0) wake(false);
+    }
+
+    void record(int stage, chrono::steady_clock::duration wait, chrono::steady_clock::duration service) {
+        StageCounters& stats = counters[stage];
+        uint64_t serviceNanoseconds = chrono::duration_cast<chrono::nanoseconds>(service).count();
+        stats.processed.fetch_add(1, memory_order_relaxed);
+        stats.waitNanoseconds.fetch_add(chrono::duration_cast<chrono::nanoseconds>(wait).count(), memory_order_relaxed);
+        stats.serviceNanoseconds.fetch_add(serviceNanoseconds, memory_order_relaxed);
+        uint64_t longest = stats.maxServiceNanoseconds.load(memory_order_relaxed);
+        while (serviceNanoseconds > longest &&
+               !stats.maxServiceNanoseconds.compare_exchange_weak(longest, serviceNanoseconds, memory_order_relaxed)) {
+        }
+    }
+
+    void advance(CheckoutJob* job, int stage) {
+        while (true) {
+            auto started = chrono::steady_clock::now();
+            if (stage == CHECKOUT_AUTHORIZE && processor.paysAsynchronously()) {
+                // The job waits for the gateway outside the pipeline; the worker moves on
+                processor.authorizeAsync(*job, [this, job, started](bool passed) {
+                    paymentCallbacks.fetch_add(1); // the job is still in flight, so the workers are too
+                    auto finished = chrono::steady_clock::now();
+                    record(CHECKOUT_AUTHORIZE, started - job->queuedAt, finished - started);
+                    handOff(job, CHECKOUT_AUTHORIZE, passed, finished, false);
+                    paymentCallbacks.fetch_sub(1);
+                });
+                return;
+            }
+            bool passed = processor.run(CheckoutStage(stage), *job);
+            auto finished = chrono::steady_clock::now();
+            record(stage, started - job->queuedAt, finished - started);
+            if (!handOff(job, stage, passed, finished, true)) return;
+            ++stage;
+        }
+    }
+
+    // Take whatever else is waiting to be validated and check the payment fields of all of
+    // them in one batch
+    void validateBatch(CheckoutJob* first) {
+        const size_t BATCH = 32;
+        CheckoutJob* jobs[BATCH];
+        PaymentFields fields[BATCH];
+        uint8_t problems[BATCH];
+        size_t count = 0;
+        jobs[count++] = first;
+        while (count < BATCH && queues[CHECKOUT_VALIDATE]->tryPop(&jobs[count])) {
+            queued.fetch_sub(1);
+            ++count;
+        }
+
+        auto started = chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            const CheckoutRequest& request = jobs[i]->request;
+            fields[i] = PaymentFields::from(request.buyerPhone, request.cardNumber, request.ccv, request.expiry);
+        }
+        PaymentValidator::checkBatch(fields, count, problems);
+        auto batchShare = (chrono::steady_clock::now() - started) / count;
+
+        for (size_t i = 0; i < count; ++i) {
+            auto cartStarted = chrono::steady_clock::now();
+            bool passed = processor.validate(*jobs[i], problems[i]);
+            auto finished = chrono::steady_clock::now();
+            record(CHECKOUT_VALIDATE, started - jobs[i]->queuedAt, batchShare + (finished - cartStarted));
+            if (handOff(jobs[i], CHECKOUT_VALIDATE, passed, finished, true)) advance(jobs[i], CHECKOUT_PRICE);
+        }
+    }
+
+    // Pass a job on once a stage is done with it. Returns true when the caller should run
+    // the next stage itself because its queue is full; callers that may not (the payment
+    // client's thread) wait for room instead.
+    bool handOff(CheckoutJob* job, int stage, bool passed, chrono::steady_clock::time_point finished,
+                 bool mayRunNext) {
+        if (!passed || stage + 1 == CHECKOUT_STAGE_COUNT) {
+            job->done(move(job->result));
+            delete job;
+            if (inFlight.fetch_sub(1) == 1 && stopping.load()) wake(true);
+            return false;
+        }
+
+        job->queuedAt = finished;
+        while (!queues[stage + 1]->tryPush(job)) {
+            if (mayRunNext) return true;
+            this_thread::yield();
+        }
+        queued.fetch_add(1);
+        if (sleepers.load() > 0) wake(false);
+        return false;
+    }
+
+    void workerLoop() {
+        while (true) {
+            CheckoutJob* job = nullptr;
+            int stage = CHECKOUT_STAGE_COUNT - 1;
+            for (; stage >= 0; --stage) {
+                if (queues[stage]->tryPop(&job)) break;
+            }
+            if (job) {
+                queued.fetch_sub(1);
+                if (stage == CHECKOUT_VALIDATE) validateBatch(job);
+                else advance(job, stage);
+                continue;
+            }
+
+            unique_lock<mutex> guard(idleLock);
+            sleepers.fetch_add(1);
+            idle.wait(guard, [this] { return queued.load() > 0 || (stopping.load() && inFlight.load() == 0); });
+            sleepers.fetch_sub(1);
+            if (queued.load() == 0 && stopping.load() && inFlight.load() == 0) return;
+        }
+    }
+
+public:
+    PipelinedCheckout(const CheckoutServices& services) : PipelinedCheckout(services, Config()) {}
+
+    PipelinedCheckout(const CheckoutServices& services, const Config& config) : processor(services) {
+        for (auto& queue : queues) queue.reset(new BoundedQueue<CheckoutJob*>(config.queueCapacity));
+        for (unsigned i = 0; i < max(1u, config.workers); ++i) workers.emplace_back([this] { workerLoop(); });
+    }
+
+    PipelinedCheckout(const PipelinedCheckout&) = delete;
+    PipelinedCheckout& operator=(const PipelinedCheckout&) = delete;
+
+    // Finishes every checkout already submitted
+    ~PipelinedCheckout() {
+        stopping.store(true);
+        wake(true);
+        for (thread& worker : workers) worker.join();
+        while (paymentCallbacks.load() > 0) this_thread::yield(); // the last one may still be waking workers
+    }
+
+    using CheckoutStrategy::submit;
+
+    void submit(CheckoutRequest request, CheckoutCallback done) override {
+        CheckoutJob* job = new CheckoutJob();
+        job->request = move(request);
+        job->done = move(done);
+        inFlight.fetch_add(1);
+        enqueue(job, CHECKOUT_VALIDATE);
+    }
+
+    size_t checkoutsInFlight() const {
+        return inFlight.load();
+    }
+
+    vector<CheckoutStageStats> stageStats() const {
+        vector<CheckoutStageStats> stats;
+        for (int stage = 0; stage < CHECKOUT_STAGE_COUNT; ++stage) {
+            const StageCounters& counter = counters[stage];
+            uint64_t processed = counter.processed.load();
+            double perCheckout = processed ? 1000.0 * processed : 1;
+            stats.push_back({CHECKOUT_STAGE_NAMES[stage], queues[stage]->depth(), processed,
+                             counter.waitNanoseconds.load() / perCheckout,
+                             counter.serviceNanoseconds.load() / perCheckout,
+                             counter.maxServiceNanoseconds.load() / 1000.0});
+        }
+        return stats;
+    }
+};
+
+// A checkout remembered by its idempotency key. Retries that arrive while it is still
+// running wait in `waiters` and are answered together with the first attempt.
+struct RecentCheckout {
+    mutex lock;
+    bool finished = false;
+    CheckoutResult result;
+    vector<CheckoutCallback> waiters;
+
+    // Hand `done` the result now, or once the first attempt finishes
+    void answer(CheckoutCallback done) {
+        unique_lock<mutex> guard(lock);
+        if (!finished) {
+            waiters.push_back(move(done));
+            return;
+        }
+        CheckoutResult copy = result;
+        guard.unlock();
+        copy.repeated = true;
+        done(move(copy));
+    }
+
+    void finish(const CheckoutResult& outcome) {
+        vector<CheckoutCallback> waiting;
+        {
+            lock_guard<mutex> guard(lock);
+            result = outcome;
+            finished = true;
+            waiting.swap(waiters);
+        }
+        for (CheckoutCallback& waiter : waiting) {
+            CheckoutResult copy = outcome;
+            copy.repeated = true;
+            waiter(move(copy));
+        }
+    }
+
+    // Whether a retry should run the checkout again: it failed before any charge was possible
+    bool mayRunAgain() {
+        lock_guard<mutex> guard(lock);
+        return finished && !result.placed && !result.chargeUncertain;
+    }
+};
+
+// Recent checkouts by idempotency key, so that a retried checkout is answered with the
+// order its first attempt placed instead of placing (and charging) a second one. The
+// capacity is fixed and split over shards with a lock each. Within a shard a CLOCK hand
+// picks what to evict: a hit sets the entry's referenced bit, and the hand clears set bits
+// as it sweeps past and evicts the first entry whose bit is already clear. A checkout that
+// failed before the card could have been charged (bad details, a declined card) is not
+// kept, so its retry runs again; one that may have charged the card answers every retry
+// with its failure.
+class CheckoutDedupCache {
+public:
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t size;
+        size_t capacity;
+    };
+
+private:
+    static constexpr size_t SHARD_COUNT = 16;
+
+    struct Slot {
+        string key;
+        uint64_t hash = 0;
+        shared_ptr<RecentCheckout> checkout;
+        bool referenced = false;
+    };
+
+    struct alignas(64) Shard {
+        mutex lock;
+        vector<Slot> slots; // grows up to the shard's capacity, then slots are reused
+        FlatIndexMap slotOfHash;
+        size_t hand = 0;
+    };
+
+    unique_ptr<Shard[]> shards{new Shard[SHARD_COUNT]};
+    size_t slotsPerShard;
+    atomic<uint64_t> hits{0}, misses{0}, evictions{0};
+
+    // The slot for a new entry, evicting one if the shard is full
+    uint32_t claimSlot(Shard& shard) {
+        if (shard.slots.size() < slotsPerShard) {
+            shard.slots.emplace_back();
+            return uint32_t(shard.slots.size() - 1);
+        }
+        while (true) {
+            uint32_t position = uint32_t(shard.hand);
+            shard.hand = (shard.hand + 1) % slotsPerShard;
+            Slot& slot = shard.slots[position];
+            if (slot.referenced) {
+                slot.referenced = false;
+                continue;
             }
+            shard.slotOfHash.erase(slot.hash);
+            evictions.fetch_add(1, memory_order_relaxed);
+            return position;
         }
-        
-        // Adds new user
-        users.emplace_back(email, password);
-        return true;
     }
 
-    // Logs in a user
-    User* logIn(const string& email, const string& password) {
-        for (auto& user : users) {
-            if (user.email == email && user.password == password) {
-                return &user;
+public:
+    CheckoutDedupCache(size_t capacity) : slotsPerShard(max<size_t>(1, (capacity + SHARD_COUNT - 1) / SHARD_COUNT)) {
+        for (size_t i = 0; i < SHARD_COUNT; ++i) shards[i].slotOfHash.reserve(slotsPerShard);
+    }
+
+    // The live entry for `key`, or nullptr after recording `checkout` as the entry for it
+    shared_ptr<RecentCheckout> findOrInsert(const string& key, const shared_ptr<RecentCheckout>& checkout) {
+        uint64_t hash = std::hash<string_view>()(key);
+        Shard& shard = shards[(hash >> 32) % SHARD_COUNT];
+        lock_guard<mutex> guard(shard.lock);
+        uint32_t position;
+        if (shard.slotOfHash.find(hash, &position)) {
+            Slot& slot = shard.slots[position];
+            if (slot.key == key && !slot.checkout->mayRunAgain()) {
+                slot.referenced = true;
+                hits.fetch_add(1, memory_order_relaxed);
+                return slot.checkout;
+            }
+            misses.fetch_add(1, memory_order_relaxed);
+            if (slot.key == key) { // the first attempt failed, so this one starts over
+                slot.checkout = checkout;
+                slot.referenced = true;
             }
-        } return nullptr;
+            return nullptr; // otherwise two keys share a 64-bit hash and the first stays cached
+        }
+
+        position = claimSlot(shard);
+        Slot& slot = shard.slots[position];
+        slot.key = key;
+        slot.hash = hash;
+        slot.checkout = checkout;
+        slot.referenced = false;
+        shard.slotOfHash.insert(hash, position);
+        misses.fetch_add(1, memory_order_relaxed);
+        return nullptr;
     }
 
-    // Finds a user by email
-    User* findUserByEmail(const string& email) {
-        for (auto& user : users) {
-            if (user.email == email) return &user;
-        } return nullptr;
+    Stats stats() {
+        size_t size = 0;
+        for (size_t i = 0; i < SHARD_COUNT; ++i) {
+            lock_guard<mutex> guard(shards[i].lock);
+            size += shards[i].slotOfHash.size();
+        }
+        return {hits.load(), misses.load(), evictions.load(), size, slotsPerShard * SHARD_COUNT};
     }
 };
 
-// Abstract class for checkout strategy
-class CheckoutStrategy {
-public:
-    virtual void checkout(const ShoppingCart& cart) = 0;
-    virtual ~CheckoutStrategy() {}
-};
+// Checkout that recognises retries: a request carrying an idempotency key its user has
+// used recently gets the first attempt's result, marked as repeated, and only the first
+// attempt reaches the wrapped strategy
+class IdempotentCheckout : public CheckoutStrategy {
+private:
+    unique_ptr<CheckoutStrategy> inner;
+    CheckoutDedupCache recent;
 
-// Standard checkout implementation
-class StandardCheckout : public CheckoutStrategy {
 public:
-    void checkout(const ShoppingCart& cart) override {
-        cart.viewCart();
-        cout << "Proceeding to standard checkout..." << endl;
+    IdempotentCheckout(unique_ptr<CheckoutStrategy> inner, size_t capacity) : inner(move(inner)), recent(capacity) {}
+
+    using CheckoutStrategy::submit;
+
+    void submit(CheckoutRequest request, CheckoutCallback done) override {
+        if (request.idempotencyKey.empty() || !request.user) {
+            inner->submit(move(request), move(done));
+            return;
+        }
+        shared_ptr<RecentCheckout> checkout = make_shared<RecentCheckout>();
+        shared_ptr<RecentCheckout> earlier = recent.findOrInsert(request.retryKey(), checkout);
+        if (earlier) {
+            earlier->answer(move(done));
+            return;
+        }
+        inner->submit(move(request), [checkout, done](CheckoutResult result) {
+            checkout->finish(result);
+            done(move(result));
+        });
+    }
 
+    CheckoutDedupCache::Stats cacheStats() {
+        return recent.stats();
     }
 };
 
 // Main application class
 class Application {
 private:
+    // Members are destroyed bottom-up: the checkout pipeline goes first, while the catalog,
+    // the accounts, the journal and the payment client it uses are all still there
     Auth auth;
-    ShoppingCart currentActiveCart;
-    vector<Product> products;
+    SessionTable sessions;
+    CatalogStore catalogStore;
+    shared_ptr<CatalogStore::Reader> catalogView; // the catalog version this session is reading; orders share the pin
+    OrderIdGenerator orderIds{1}; // node 1: the only store process for now
+    OrderJournal journal;         // every placed order, so purchase history survives a restart
+    // Exclusive while an order joins a purchase history or a cart is changed; the snapshot
+    // writer holds it shared while it copies the accounts
+    shared_mutex accountsLock;
+    shared_ptr<SnapshotSource> restoredSnapshot; // where restored histories are decoded from
+    size_t damagedHistoriesShown = 0;
+    unique_ptr<SnapshotWriter> snapshots; // accounts, carts and histories, saved at logout and exit
+    PaymentGatewaySimulator paymentGateway; // stands in for the card processor
+    PaymentClient payments{paymentGateway};
+    unique_ptr<CheckoutStrategy> checkoutStrategy; // validates, charges, saves and delivers orders
     User* currentUser = nullptr;
+    ShoppingCart* activeCart = nullptr; // the logged-in user's own cart, edited in place
+    SessionTable::Token sessionToken = 0;
+    uint64_t checkoutsStarted = 0; // numbers this session's checkouts for their idempotency keys
 
 public: 
     // Constructor to initialize the application with products
-    Application() {
-        products.emplace_back("0001", "Canva Template Pack", 50.00, "Digital Templates");
-        products.emplace_back("0002", "Resume Template", 10.00, "Digital Templates");
-        products.emplace_back("0003", "Presentation Template PPT", 20.00, "Digital Templates");
-        products.emplace_back("0004", "Instagram Story Templates", 8.00, "Digital Templates");
-        products.emplace_back("0005", "Website Theme HTML", 120.00, "Digital Templates");
-
-        products.emplace_back("1001", "Ebook: Learn Coding", 20.00, "Educational Content");
-        products.emplace_back("1002", "Online Course: Design Basics", 50.00, "Educational Content");
-        products.emplace_back("1003", "Study Guide - Math", 25.00, "Educational Content");
-        products.emplace_back("1004", "Language Learning Pack", 22.00, "Educational Content");
-        products.emplace_back("1005", "Printable Planner Set", 115.00, "Educational Content");
-
-        products.emplace_back("2001", "Stock Photos Bundle", 30.00, "Creative Assets");
-        products.emplace_back("2002", "Vector Graphics Pack", 28.00, "Creative Assets");
-        products.emplace_back("2003", "Font Collection", 23.00, "Creative Assets");
-        products.emplace_back("2004", "Icon Set", 18.00, "Creative Assets");
-        products.emplace_back("2005", "Photoshop Presets", 45.00, "Creative Assets");
-
-        products.emplace_back("3001", "Mobile App: Productivity", 40.00, "Software & Tools");
-        products.emplace_back("3002", "WordPress Plugin Premium", 35.00, "Software & Tools");
-        products.emplace_back("3003", "Website Builder Theme", 45.00, "Software & Tools");
-        products.emplace_back("3004", "API Access Pack", 130.00, "Software & Tools");
-        products.emplace_back("3005", "SDK for Developers", 180.00, "Software & Tools");
-
-        products.emplace_back("4001", "Royalty-Free Music Pack", 30.00, "Music & Audio");
-        products.emplace_back("4002", "Sound Effects Collection", 25.00, "Music & Audio");
-        products.emplace_back("4003", "Audiobook: Business Success", 25.00, "Music & Audio");
-        products.emplace_back("4004", "Paid Podcast Subscription", 55.00, "Music & Audio");
-        products.emplace_back("4005", "Voiceover Samples", 20.00, "Music & Audio");
-
-        products.emplace_back("5001", "Business Plan Template", 169.00, "Business & Marketing");
-        products.emplace_back("5002", "Marketing Kit", 49.00, "Business & Marketing");
-        products.emplace_back("5003", "Email Template Set", 18.00, "Business & Marketing");
-        products.emplace_back("5004", "Logo Design Files", 45.00, "Business & Marketing");
-        products.emplace_back("5005", "Brand Style Guide", 50.00, "Business & Marketing");
+    // Uses the binary catalog file when one is available, otherwise the built-in product list,
+    // then restores the last store snapshot and replays the newer part of the order journal
+    Application(const string& catalogPath = "catalog.bin", const string& journalPath = "orders.journal",
+                const string& snapshotPath = "store.snapshot") {
+        string errorMessage;
+        unique_ptr<CatalogSnapshot> snapshot(new CatalogSnapshot());
+        bool loaded = false;
+        ifstream probe(catalogPath);
+        if (probe) {
+            probe.close();
+            loaded = snapshot->catalog.loadFromFile(catalogPath, &errorMessage);
+            if (!loaded) {
+                cout << "Could not load " << catalogPath << ": " << errorMessage
+                     << " Using the built-in catalog." << endl;
+            }
+        }
+        if (!loaded) {
+            snapshot->catalog.loadStatic(SEED_CATALOG_IMAGE.data(), SEED_CATALOG_IMAGE.size(), &SEED_ID_HASH, &errorMessage);
+        }
+        publishCatalog(move(snapshot));
+        catalogStore.saveChangesTo(catalogPath); // the built-in catalog is written out on the first change
+
+        JournalPosition journalPosition;
+        size_t restoredUsers = 0;
+        ifstream snapshotProbe(snapshotPath);
+        if (snapshotProbe) {
+            snapshotProbe.close();
+            if (!restoreStoreSnapshot(snapshotPath, auth, catalog(), &journalPosition, &restoredUsers,
+                                      &restoredSnapshot, &errorMessage)) {
+                cout << "Could not restore " << snapshotPath << ": " << errorMessage << endl;
+                journalPosition = JournalPosition();
+            }
+        }
+        openJournal(journalPath, journalPosition);
+        snapshots.reset(new SnapshotWriter(snapshotPath, [this] { return captureSnapshot(); }));
+
+        CheckoutServices services;
+        services.orderIds = &orderIds;
+        services.journal = &journal;
+        services.payments = &payments;
+        services.accounts = &accountsLock;
+        checkoutStrategy.reset(new IdempotentCheckout(unique_ptr<CheckoutStrategy>(new PipelinedCheckout(services)), 4096));
+    }
+
+    // Finish every order still on its way, then save the store one last time
+    ~Application() {
+        checkoutStrategy.reset();
+        saveSnapshot();
+        snapshots->flush();
+        showProblems();
     }
 
     // Main application loop
     void run() {
         while (true) {
+            showProblems();
             cout << "\n" << string(50, '=') << endl;
             cout << "      Welcome to National Brokestore!         " << endl;
             cout << string(50, '=') << endl;
 
             char choice;
-            cout << "Are you a registered user? (Y = Login, N = Sign Up, E = Exit): ";
+            cout << "Are you a registered user? (Y = Login, N = Sign Up, R = Resume Session, E = Exit): ";
             cin >> choice;
             cin.ignore();
 
             if (toupper(choice) == 'E') {
                 cout << "Exiting program. Goodbye!" << endl;
-                currentActiveCart.clearCart(); // Clear cart on exit
                 break;
             }
             else if (toupper(choice) == 'Y') {
                 bool loggedIn = logIn(); // Attempt to log in
                 if (!loggedIn) {
                     cout << "Exiting program. Goodbye!" << endl;
-                    currentActiveCart.clearCart();
                     break;
                 }
                 mainMenu(); // Show User Dashboard after login
@@ -312,17 +4828,302 @@ public:
                 bool signedUp = signUpAndLogin(); // Attempt to sign up and log in
                 if (!signedUp) {
                     cout << "Exiting program. Goodbye!" << endl;
-                    currentActiveCart.clearCart();
                     break;
                 }
                 mainMenu();
+            } else if (toupper(choice) == 'R') {
+                if (resumeSession()) mainMenu();
             } else {
-                cout << "Invalid option. Please enter Y, N, or E." << endl;
+                cout << "Invalid option. Please enter Y, N, R, or E." << endl;
             }
         }
     }
 
+    // Store operations without any prompts or output, used by the menus and by batch mode.
+    // The ones that can fail return false with the reason in *errorMessage.
+
+    // Log a user in and open their session
+    User* logInUser(const string& email, const string& password) {
+        User* user = auth.logIn(email, password);
+        if (user) openSession(user);
+        return user;
+    }
+
+    // Sign a new user up and log them in
+    bool signUpUser(const string& email, const string& password, string* errorMessage) {
+        if (!auth.signUp(email, password, errorMessage)) return false;
+        User* user = auth.findUserByEmail(email);
+        if (!user) {
+            *errorMessage = "Unexpected error: user not found after sign-up.";
+            return false;
+        }
+        openSession(user);
+        return true;
+    }
+
+    // End the session, so its token no longer lets anyone back in. The cart is the user's
+    // own, so there is nothing to save; the store snapshot is written unless saveNow is
+    // false (batch mode leaves it to the end of the run).
+    void logOut(bool saveNow = true) {
+        sessions.close(sessionToken);
+        sessionToken = 0;
+        stepAway(saveNow);
+    }
+
+    // Leave the store with the session still open, to be resumed with its token until it expires
+    void stepAway(bool saveNow = true) {
+        currentUser = nullptr;
+        activeCart = nullptr;
+        if (saveNow) saveSnapshot();
+    }
+
+    User* loggedInUser() const {
+        return currentUser;
+    }
+
+    // Read the logged-in user's cart. A checkout that was not placed puts its lines back from
+    // the checkout's thread, so the cart is only read under the accounts lock.
+    template <typename Reader>
+    auto readCart(Reader read) {
+        shared_lock<shared_mutex> guard(accountsLock);
+        return read(static_cast<const ShoppingCart&>(*activeCart));
+    }
+
+    // Read the logged-in user's purchase history, which orders join from the checkout's threads
+    template <typename Reader>
+    auto readHistory(Reader read) {
+        shared_lock<shared_mutex> guard(accountsLock);
+        return read(static_cast<const vector<Order>&>(currentUser->orders()));
+    }
+
+    // Products on sale whose name contains the term
+    vector<uint32_t> searchCatalog(const string& term) {
+        return view().search.search(term);
+    }
+
+    // Add a product, found by ID or name, at its current price
+    bool addToCart(const string& product, int quantity, string* errorMessage) {
+        ProductHandle index = 0;
+        if (activeCart && quantity > 0 && !findProduct(product, nullptr, &index)) {
+            *errorMessage = "Product not found.";
+            return false;
+        }
+        return addToCart(index, quantity, errorMessage);
+    }
+
+    bool addToCart(ProductHandle product, int quantity, string* errorMessage) {
+        if (!activeCart) {
+            *errorMessage = "No user logged in.";
+            return false;
+        }
+        if (quantity <= 0) {
+            *errorMessage = "Invalid quantity. Please enter a positive number.";
+            return false;
+        }
+        lock_guard<shared_mutex> guard(accountsLock);
+        activeCart->addItem(product, quantity, catalog().price(product));
+        return true;
+    }
+
+    bool removeFromCart(const string& id, string* errorMessage) {
+        ProductHandle product;
+        int quantity;
+        if (!findCartItem(id, &product, &quantity)) {
+            *errorMessage = "Item not found in cart.";
+            return false;
+        }
+        lock_guard<shared_mutex> guard(accountsLock);
+        activeCart->removeItem(product);
+        return true;
+    }
+
+    bool changeCartQuantity(const string& id, int quantity, string* errorMessage) {
+        ProductHandle product;
+        int currentQuantity;
+        if (!findCartItem(id, &product, &currentQuantity)) {
+            *errorMessage = "Item not found in cart.";
+            return false;
+        }
+        if (quantity <= 0) {
+            *errorMessage = "Invalid quantity. Please enter a positive number.";
+            return false;
+        }
+        lock_guard<shared_mutex> guard(accountsLock);
+        activeCart->updateQuantity(product, quantity);
+        return true;
+    }
+
+    // Take products retired since they were added out of the cart, as they can no longer be
+    // bought; returns their names
+    vector<string> dropRetiredItems() {
+        vector<string> dropped;
+        if (!activeCart) return dropped;
+        lock_guard<shared_mutex> guard(accountsLock);
+        activeCart->removeItemsIf([&](const CartLine& item) {
+            if (!catalog().isRetired(item.product)) return false;
+            dropped.emplace_back(catalog().name(item.product));
+            return true;
+        });
+        return dropped;
+    }
+
+    // Submit the cart with the buyer's details without waiting for the result. The cart's lines
+    // move into the request, so whatever is added meanwhile is a new cart and never part of this
+    // order; if the order is not placed, or the request was a retry answered with an earlier
+    // attempt's result (which did not buy these lines), they are put back into the buyer's cart
+    // before the result is handed over.
+    future<CheckoutResult> startOrder(CheckoutRequest request) {
+        request.user = currentUser;
+        request.catalog = &catalog();
+        request.catalogPin = catalogView;
+        if (request.idempotencyKey.empty()) request.idempotencyKey = newIdempotencyKey();
+        ShoppingCart* cart = activeCart;
+        if (cart) {
+            lock_guard<shared_mutex> guard(accountsLock);
+            request.lines = cart->lines();
+            cart->clearCart();
+        }
+
+        shared_ptr<promise<CheckoutResult>> done = make_shared<promise<CheckoutResult>>();
+        future<CheckoutResult> result = done->get_future();
+        vector<CartLine> lines = request.lines;
+        checkoutStrategy->submit(move(request), [this, cart, lines, done](CheckoutResult outcome) {
+            if ((!outcome.placed || outcome.repeated) && cart) {
+                lock_guard<shared_mutex> guard(accountsLock);
+                for (const CartLine& line : lines) cart->addItem(line.product, line.quantity, line.unitPrice);
+            }
+            done->set_value(move(outcome));
+        });
+        return result;
+    }
+
+    // Submit the cart and wait; the cart is only left empty once the order has been placed.
+    // A request that is sent again with the same idempotency key is a retry.
+    CheckoutResult placeOrder(CheckoutRequest& request) {
+        if (request.idempotencyKey.empty()) request.idempotencyKey = newIdempotencyKey();
+        return startOrder(request).get();
+    }
+
+    // Bulk-import accounts from an "email,password" CSV into this store; they are saved with
+    // the store snapshot written when the application closes
+    bool importUsers(const string& csvPath, unsigned threads, ostream& rowErrors, ImportSummary* summary,
+                     string* errorMessage) {
+        return importUsersCsv(auth, csvPath, threads, rowErrors, summary, errorMessage);
+    }
+
+    // Switch to the newest catalog version (only between menus, when no page of the old one is shown)
+    void refreshCatalog() {
+        catalogView = make_shared<CatalogStore::Reader>(catalogStore.read());
+        catalogStore.reclaim(); // the version this session read before may have been the last pin
+        syncCartPrices();
+    }
+
 private: 
+    // Replay past orders into purchase histories and start journaling new ones
+    void openJournal(const string& path, const JournalPosition& snapshotPosition) {
+        FlatIndexMap handleOfId = handlesById(catalog()); // retired products too, old orders may name them
+
+        size_t replayed = 0, unknownUsers = 0, unreadable = 0, missingProducts = 0;
+        string errorMessage;
+        bool opened = journal.open(path, snapshotPosition, [&](string_view record) {
+            string email;
+            Order order;
+            if (!decodeOrderRecord(record, handleOfId, &email, &order, &missingProducts)) {
+                ++unreadable;
+                return;
+            }
+            User* user = auth.findUserByEmail(email);
+            if (!user) {
+                ++unknownUsers;
+                return;
+            }
+            user->addOrder(order);
+            ++replayed;
+        }, &errorMessage);
+        if (!opened) {
+            cout << "Order journal unavailable (" << errorMessage << "); orders will not be saved." << endl;
+            return;
+        }
+        if (unknownUsers || unreadable || missingProducts) {
+            cout << "Order journal: restored " << replayed << " orders; skipped " << unknownUsers
+                 << " for unknown accounts, " << unreadable << " unreadable, and " << missingProducts
+                 << " items no longer in the catalog." << endl;
+        }
+    }
+
+    // Have the background writer save the accounts, carts and histories
+    void saveSnapshot() {
+        if (snapshots) snapshots->request();
+    }
+
+    // Encode the store as it is at one moment; runs on the snapshot writer's thread. The
+    // journal is cut while no order can join a history, so the snapshot replays exactly the
+    // orders it does not hold, even with checkouts between persist and deliver.
+    string captureSnapshot() {
+        CatalogStore::Reader newest = catalogStore.read(); // handles stay valid in later versions
+        shared_lock<shared_mutex> guard(accountsLock);
+        return encodeStoreSnapshot(auth, newest->catalog, journal.cut());
+    }
+
+    // Problems the background threads ran into since the last call
+    vector<string> backgroundProblems() {
+        vector<string> problems;
+        string errorMessage;
+        if (snapshots && snapshots->takeFailure(&errorMessage)) {
+            problems.push_back("Could not save the store snapshot: " + errorMessage);
+        }
+        size_t damaged = restoredSnapshot ? restoredSnapshot->damagedHistories.load() : 0;
+        if (damaged > damagedHistoriesShown) {
+            problems.push_back(damaged - damagedHistoriesShown == 1
+                                   ? string("A stored purchase history is damaged and was skipped.")
+                                   : to_string(damaged - damagedHistoriesShown) +
+                                         " stored purchase histories are damaged and were skipped.");
+            damagedHistoriesShown = damaged;
+        }
+        return problems;
+    }
+
+    void showProblems() {
+        for (const string& problem : backgroundProblems()) cout << "\n" << problem << endl;
+    }
+
+    // Make a catalog snapshot current and start reading it
+    void publishCatalog(unique_ptr<CatalogSnapshot> snapshot) {
+        catalogStore.publish(move(snapshot));
+        catalogView = make_shared<CatalogStore::Reader>(catalogStore.read());
+    }
+
+    // Reprice the cart if the catalog changed since its prices were taken
+    void syncCartPrices() {
+        if (!activeCart) return;
+        lock_guard<shared_mutex> guard(accountsLock);
+        if (activeCart->pricedVersion() != view().version) activeCart->reprice(catalog(), view().version);
+    }
+
+    // A key for a checkout that is not a retry: this session's token and a running number
+    string newIdempotencyKey() {
+        return SessionTable::formatToken(sessionToken) + "/" + to_string(++checkoutsStarted);
+    }
+
+    bool cartIsEmpty() {
+        shared_lock<shared_mutex> guard(accountsLock);
+        return activeCart->isEmpty();
+    }
+
+    void showCart() {
+        shared_lock<shared_mutex> guard(accountsLock);
+        activeCart->viewCart(catalog());
+    }
+
+    // The catalog version this session is reading
+    CatalogSnapshot& view() const {
+        return **catalogView;
+    }
+
+    const Catalog& catalog() const {
+        return view().catalog;
+    }
+
     // Convert string to lowercase
     string toLower(string s) {
         for (char &c : s) {
@@ -330,6 +5131,44 @@ private:
         } return s;
     }
 
+    // Make a user the current one, working on their saved cart directly
+    void attachUser(User* user) {
+        currentUser = user;
+        activeCart = &user->userCart;
+        syncCartPrices();
+    }
+
+    // Make a user the current one in a session they can resume with its token
+    void openSession(User* user) {
+        attachUser(user);
+        sessionToken = sessions.open(user, monotonicSeconds());
+    }
+
+    // Tell a user who just logged in how to resume their session
+    void announceSession() {
+        if (sessionToken == 0) return; // no secure token could be made; the user just has to log in again
+        cout << "Session token: " << SessionTable::formatToken(sessionToken)
+             << " (resume with R for up to " << sessions.ttl() / 60 << " minutes after stepping away)" << endl;
+    }
+
+    // Pick up a session from its token, without the password
+    bool resumeSession() {
+        cout << "\n=== Resume Session ===" << endl;
+        cout << "Session token: ";
+        string text;
+        getline(cin, text);
+        SessionTable::Token token;
+        User* user = SessionTable::parseToken(text, &token) ? sessions.resume(token, monotonicSeconds()) : nullptr;
+        if (!user) {
+            cout << "Unknown or expired session. Please log in." << endl;
+            return false;
+        }
+        sessionToken = token;
+        attachUser(user);
+        cout << "Welcome back, " << user->email << "!" << endl;
+        return true;
+    }
+
     bool logIn() { // Log in a user
         string email, password;
         while (true) {
@@ -342,11 +5181,11 @@ private:
             cout << "==============" << endl;
 
             // Attempt to log in
-            currentUser = auth.logIn(email, password);
+            User* user = logInUser(email, password);
 
-            if (currentUser) {
+            if (user) {
                 cout << "Login successful!" << endl;
-                currentActiveCart.setItems(currentUser->userCart.getItems()); // Load user's cart
+                announceSession();
                 return true;
              } else {
 
@@ -373,13 +5212,9 @@ private:
             getline(cin, password);
             cout << "==============" << endl;
 
-            if (auth.signUp(email, password, &errorMessage)) {
+            if (signUpUser(email, password, &errorMessage)) {
                 cout << "Sign up successful! Logging you in now..." << endl;
-                currentUser = auth.findUserByEmail(email); // Find the newly signed-up user
-                if (!currentUser) {
-                    cout << "Unexpected error: user not found after sign-up." << endl;
-                    return false;
-                } 
+                announceSession();
                 return true;
             } else {
                 cout << errorMessage << endl;
@@ -396,11 +5231,15 @@ private:
     void mainMenu() {
         int choice;
         while (true) {
+            refreshCatalog(); // pick up catalog changes made since the last menu
+            showProblems();
            cout << "\n======= User Dashboard =======" << endl;
             cout << "1. Browse Products" << endl;
             cout << "2. Digital Shopping Cart" << endl;
             cout << "3. Purchase History" << endl;
             cout << "4. Logout" << endl;
+            cout << "5. Step Away (keep your session to resume later)" << endl;
+            if (currentUser && currentUser->isAdmin) cout << "6. Manage Products" << endl;
             cout << "==============================" << endl;
 
             cout << "Enter your choice: ";
@@ -418,24 +5257,101 @@ private:
                 case 3: purchaseHistory(); break;
                 case 4:
                     cout << "Logging out..." << endl;
-                    if (currentUser) {
-                        currentUser->userCart.setItems(currentActiveCart.getItems()); // Save cart before logout
-                        currentActiveCart.clearCart(); // Clear current cart
-                        currentUser = nullptr; // Reset current user
-                    } 
+                    logOut();
                     return;
+                case 5:
+                    cout << "Stepping away; your session token stays valid for " << sessions.ttl() / 60 << " minutes." << endl;
+                    stepAway();
+                    return;
+                case 6:
+                    if (currentUser && currentUser->isAdmin) {
+                        manageProductsMenu();
+                        break;
+                    }
+                    cout << "Invalid choice. Please try again." << endl;
+                    break;
                 default:
                     cout << "Invalid choice. Please try again." << endl;
             }
         }
     }
 
+    // Admin menu for changing the catalog; each change is saved to the catalog file and
+    // published as a new version while shoppers keep reading the version they started with
+    void manageProductsMenu() {
+        int choice;
+        while (true) {
+            cout << "\n===== Manage Products =====" << endl;
+            cout << "Catalog version " << view().version << ", " << catalog().activeCount() << " products on sale" << endl;
+            cout << "1. Add Product" << endl;
+            cout << "2. Change Product Price" << endl;
+            cout << "3. Retire Product" << endl;
+            cout << "4. Sales Report" << endl;
+            cout << "5. Back to User Dashboard" << endl;
+            cout << string(27, '=') << endl;
+
+            cout << "Enter your choice: ";
+            while (!(cin >> choice)) {
+                cout << "Invalid input. Please enter a number: ";
+                cin.clear();
+                cin.ignore(100, '\n');
+            }
+            cin.ignore(100, '\n');
+
+            string id, errorMessage;
+            bool updated = false;
+            if (choice == 1) {
+                string name, category;
+                Money price;
+                cout << "Product ID: ";
+                getline(cin, id);
+                cout << "Name: ";
+                getline(cin, name);
+                cout << "Category: ";
+                getline(cin, category);
+                if (!readPrice("Price in Php.: ", &price)) {
+                    cout << "Product not added." << endl;
+                    continue;
+                }
+                updated = catalogStore.addProduct(Product(id, name, price, category), &errorMessage);
+            } else if (choice == 2) {
+                Money price;
+                cout << "Product ID: ";
+                getline(cin, id);
+                if (!readPrice("New price in Php.: ", &price)) {
+                    cout << "Price not changed." << endl;
+                    continue;
+                }
+                updated = catalogStore.changePrice(id, price, &errorMessage);
+            } else if (choice == 3) {
+                cout << "Product ID: ";
+                getline(cin, id);
+                updated = catalogStore.retireProduct(id, &errorMessage);
+            } else if (choice == 4) {
+                salesReport();
+                continue;
+            } else if (choice == 5) {
+                return;
+            } else {
+                cout << "Invalid choice. Please try again." << endl;
+                continue;
+            }
+
+            if (updated) {
+                refreshCatalog();
+                cout << "Catalog updated to version " << view().version << "." << endl;
+            } else {
+                cout << errorMessage << endl;
+            }
+        }
+    }
+
     // Menu for viewing and editing the shopping cart
    void digitalShoppingCartMenu() {
         int choice;
         while (true) {
             cout << "\nViewing Cart:" << endl;
-            currentActiveCart.viewCart();
+            showCart();
             cout << "\n=== Digital Shopping Cart ===" << endl;
             cout << "1. Update Cart" << endl;
             cout << "2. Checkout Items" << endl;
@@ -463,8 +5379,15 @@ private:
         }
     }
 
+    // Display a single catalog entry
+    void displayProduct(ProductHandle index) {
+        cout << catalog().id(index) << " - " << catalog().name(index)
+             << " - Category: " << catalog().category(index)
+             << " - Price: Php. " << catalog().price(index) << endl;
+    }
+
     // Display products in a formatted manner
-    void displayProducts(const vector<Product>& productsToDisplay) {
+    void displayProducts(ProductIndexSpan productsToDisplay) {
         if (productsToDisplay.empty()) {
             cout << "No products to display." << endl;
             return;
@@ -472,24 +5395,60 @@ private:
 
         cout << string(27, '-') << endl;
 
-        for (const auto& product : productsToDisplay) {
-            cout << product.id << " - " << product.name
-                 << " - Category: " << product.category
-                 << " - Price: Php. " << fixed << setprecision(2) << product.price << endl;
+        for (uint32_t index : productsToDisplay) {
+            displayProduct(index);
         }
         cout << string(27, '-') << endl;
     }
 
+    // Display the current page of a pager, with its position and sort order
+    void displayPage(const ProductPager& pager) {
+        displayProducts(pager.page());
+        cout << "Page " << pager.pageNumber() << " of " << pager.pageCount()
+             << " (" << pager.totalProducts() << " products, sorted by " << sortOrderName(pager.sortOrder()) << ")" << endl;
+    }
+
+    // Handle the paging options shared by the product lists; returns false for any other choice
+    bool handlePagingChoice(int choice, int nextOption, ProductPager& pager) {
+        if (choice == nextOption) {
+            if (!pager.next()) cout << "You are on the last page." << endl;
+        } else if (choice == nextOption + 1) {
+            if (!pager.previous()) cout << "You are on the first page." << endl;
+        } else if (choice == nextOption + 2) {
+            cout << "Sort by:\n1. Catalog order\n2. Price, low to high\n3. Price, high to low\n4. Name\n5. Category\nChoose: ";
+            int sortChoice;
+            while (!(cin >> sortChoice)) {
+                cout << "Invalid input. Please enter a number: ";
+                cin.clear();
+                cin.ignore(100, '\n');
+            }
+            cin.ignore(100, '\n');
+            if (sortChoice < 1 || sortChoice > 5) {
+                cout << "Invalid sort choice." << endl;
+            } else {
+                pager.setOrder(SortOrder(sortChoice - 1));
+            }
+        } else {
+            return false;
+        }
+        return true;
+    }
+
     // Menu for browsing products
     void browseProductsMenu() {
+        ProductPager pager(catalog());
         int choice;
         while (true) {
             cout << "\n===== Browse Products =====" << endl;
-            displayProducts(products);
+            displayPage(pager);
             cout << "1. Search Products" << endl;
             cout << "2. Filter Products by Category" << endl;
             cout << "3. Add Product to Cart" << endl;
             cout << "4. Back to User Dashboard" << endl;
+            cout << "5. Next Page" << endl;
+            cout << "6. Previous Page" << endl;
+            cout << "7. Change Sort Order" << endl;
+            cout << "8. Filter Products by Price Range" << endl;
             cout << string(24, '=') << endl;
 
             cout << "Enter your choice: ";
@@ -503,26 +5462,33 @@ private:
             switch (choice) {
                 case 1: searchProducts(); break;
                 case 2: filterProducts(); break;
-                case 3: addProductToCart(products); break;
+                case 3: addProductToCart(nullptr); break;
                 case 4: return;
+                case 8: filterProductsByPrice(); break;
                 default:
-                    cout << "Invalid choice. Please try again." << endl;
+                    if (!handlePagingChoice(choice, 5, pager))
+                        cout << "Invalid choice. Please try again." << endl;
             }
         }
     }
 
     // Handles user options after browsing/searching products results
-    void handleProductSelectionFromResults(const vector<Product>& currentResults) {
+    void handleProductSelectionFromResults(ProductIndexSpan currentResults, SortOrder resultOrder = SortOrder::Catalog) {
         if (currentResults.empty()) {
             cout << "No products to select from." << endl;
             return;
         }
 
+        ProductPager pager(catalog(), currentResults, resultOrder);
+        displayPage(pager);
         int choice;
         while (true) {
             cout << "\nWhat would you like to do with these results?" << endl;
             cout << "1. Add a product to cart" << endl;
             cout << "2. Continue Browse" << endl;
+            cout << "3. Next Page" << endl;
+            cout << "4. Previous Page" << endl;
+            cout << "5. Change Sort Order" << endl;
 
             cout << "Enter your choice: ";
 
@@ -535,14 +5501,18 @@ private:
 
             switch (choice) {
                 case 1:
-                    addProductToCart(currentResults); 
+                    addProductToCart(&currentResults); 
                     cout << "\nCurrently viewing the same search/filter results." << endl;
-                    displayProducts(currentResults);
+                    displayPage(pager);
                     break;
                 case 2:
                     return; // Continue browsing
                 default:
-                    cout << "Invalid choice. Please try again." << endl;
+                    if (handlePagingChoice(choice, 3, pager)) {
+                        displayPage(pager);
+                    } else {
+                        cout << "Invalid choice. Please try again." << endl;
+                    }
             }
         }
     }
@@ -556,28 +5526,13 @@ private:
         cout << "Enter search term: ";
         string term;
         getline(cin, term);
-        string lowerTerm = toLower(term);
 
-        vector<Product> foundProducts;
-        for (const auto& product : products) {
-            string lowerName = toLower(product.name);
-            bool found = false;
-            for (size_t i = 0; i + lowerTerm.length() <= lowerName.length(); ++i) {
-                if (lowerName.substr(i, lowerTerm.length()) == lowerTerm) {
-                    found = true;
-                    break;
-                }
-            }
-            if (found) {
-                foundProducts.push_back(product);
-            }
-        }
+        vector<uint32_t> foundProducts = searchCatalog(term);
 
         if (foundProducts.empty()) {
             cout << "No products found containing: " << term << endl;
         } else {
             cout << "\nSearch Results for '" << term << "':" << endl;
-            displayProducts(foundProducts);
             handleProductSelectionFromResults(foundProducts);
         }
     }
@@ -588,19 +5543,7 @@ private:
         cout << "Filter Products By Category:" << endl;
         cout << string(29, '=') << endl;
 
-        vector<string> categories;
-        for (const auto& p : products) {
-            bool exists = false;
-            for (const string& cat : categories) {
-                if (cat == p.category) {
-                    exists = true;
-                    break;
-                }
-            }
-            if (!exists) {
-                categories.push_back(p.category); // Collect unique categories
-            }
-        }
+        const vector<string_view>& categories = view().categories.categories();
 
         if(categories.empty()) {
             cout << "No categories found." << endl;
@@ -626,66 +5569,124 @@ private:
             return;
         }
 
-        string selectedCategory = categories[catChoice-1];
-        vector<Product> filteredProducts;
-        for (const auto& product : products) {
-            if (product.category == selectedCategory) {
-                 filteredProducts.push_back(product);
-            }
-        }
+        string_view selectedCategory = categories[catChoice-1];
+        ProductIndexSpan filteredProducts = view().categories.productsIn(catChoice-1);
 
         cout << "\nProducts in category: " << selectedCategory << endl;
-        displayProducts(filteredProducts);
         handleProductSelectionFromResults(filteredProducts);
     }
 
-    // Add product to cart from a list of available products
-    void addProductToCart(const vector<Product>& availableProducts) {
-        cout << "\nAdd to Cart:" << endl;
-        if (availableProducts.empty()) {
-            cout << "No products available to add." << endl;
+    // Revenue over every account's orders, overall and per category. Order totals and line
+    // prices are gathered into columns first so they can be summed with the bulk kernels.
+    void salesReport() {
+        vector<Money> orderTotals;
+        size_t itemsSold = 0;
+        vector<vector<Money>> unitPrices(catalog().categoryCount());
+        vector<vector<int32_t>> quantities(catalog().categoryCount());
+        shared_lock<shared_mutex> guard(accountsLock); // orders keep arriving from the checkout's threads
+        auth.forEachUser([&](User& user) {
+            for (const Order& order : user.orders()) {
+                orderTotals.push_back(order.totalPrice);
+                itemsSold += order.totalQuantity;
+                for (const PurchasedItem& item : order.purchasedItems) {
+                    uint16_t category = catalog().categoryId(item.product);
+                    unitPrices[category].push_back(item.priceAtPurchase);
+                    quantities[category].push_back(item.quantity);
+                }
+            }
+        });
+
+        cout << "\n===== Sales Report =====" << endl;
+        if (orderTotals.empty()) {
+            cout << "No orders yet." << endl;
             return;
         }
-  
-        cout << "Enter product ID or name to add (or 'exit' to cancel): ";
-        string input;
-        getline(cin, input);
-        if (toLower(input) == "exit") return;
+        Money revenue = sumAmounts(orderTotals.data(), orderTotals.size());
+        cout << "Orders: " << orderTotals.size() << endl;
+        cout << "Items sold: " << itemsSold << endl;
+        cout << "Revenue: Php. " << revenue << endl;
+        cout << "Average order: Php. " << Money::fromCentavos(revenue.centavos() / int64_t(orderTotals.size())) << endl;
+        cout << "Revenue by category:" << endl;
+        for (uint16_t category = 0; category < catalog().categoryCount(); ++category) {
+            if (unitPrices[category].empty()) continue;
+            cout << "  " << catalog().categoryName(category) << ": Php. "
+                 << sumLineTotals(unitPrices[category].data(), quantities[category].data(), unitPrices[category].size())
+                 << endl;
+        }
+        cout << string(24, '=') << endl;
+    }
 
-        const Product* productPtr = nullptr;
+    // Read a price in pesos; an empty answer means "no limit"
+    bool readPrice(const string& prompt, Money* price) {
+        while (true) {
+            cout << prompt;
+            string input;
+            getline(cin, input);
+            if (input.empty()) return false;
+            if (Money::parse(input, price) && *price >= Money()) return true;
+            cout << "Invalid price. Please enter an amount like 50 or 49.99." << endl;
+        }
+    }
 
-        // Try find by ID
-        for (const auto& product : availableProducts) {
-            if (product.id == input) { 
-                productPtr = &product; 
-                break;
-            }
+    // Filter products by price range, with the number of products per price bucket
+    void filterProductsByPrice() {
+        cout << string(29, '=') << endl;
+        cout << "Filter Products By Price:" << endl;
+        cout << string(29, '=') << endl;
+
+        Money minPrice, maxPrice = Money::fromCentavos(INT64_MAX);
+        readPrice("Minimum price in Php. (Enter for none): ", &minPrice);
+        readPrice("Maximum price in Php. (Enter for none): ", &maxPrice);
+        if (maxPrice < minPrice) {
+            cout << "The maximum price is lower than the minimum price." << endl;
+            return;
         }
 
-        // If not found by ID, try find by partial name
-        if (!productPtr) {
-            string lowerInput = toLower(input);
-            for (const auto& product : availableProducts) {
-                string lowerName = toLower(product.name);
-                bool found = false;
-                for (size_t i = 0; i + lowerInput.length() <= lowerName.length(); ++i) {
-                    if (lowerName.substr(i, lowerInput.length()) == lowerInput) {
-                        found = true;
-                        break;
-                    }
-                } 
-                if (found) {
-                    productPtr = &product;
-                    break;
-                }
+        static const vector<int64_t> bucketBounds = {0, 2500, 5000, 10000, 20000};
+        vector<PriceBucket> facets;
+        ProductIndexSpan inRange = view().prices.range(minPrice.centavos(), maxPrice.centavos(), bucketBounds, &facets);
+        if (inRange.empty()) {
+            cout << "No products found in that price range." << endl;
+            return;
+        }
+
+        cout << "\nProducts by price:" << endl;
+        for (const PriceBucket& bucket : facets) {
+            cout << "  Php. " << Money::fromCentavos(bucket.fromCentavos);
+            if (bucket.toCentavos == INT64_MAX) {
+                cout << " and up";
+            } else {
+                cout << " to under Php. " << Money::fromCentavos(bucket.toCentavos);
             }
+            cout << ": " << bucket.count << endl;
         }
+        handleProductSelectionFromResults(inRange, SortOrder::PriceLowToHigh);
+    }
 
-        if (!productPtr) {
-            cout << "Product not found in the current list." << endl;
-            return;
+    // Find a product by ID, or by partial name if no ID matches
+    // Looks only at the given results, or at the whole catalog when there are none
+    bool findProduct(const string& input, const ProductIndexSpan* availableProducts, ProductHandle* foundIndex) {
+        // Try find by ID
+        ProductHandle index;
+        if (view().ids.find(input, &index) &&
+            (!availableProducts || find(availableProducts->begin(), availableProducts->end(), index) != availableProducts->end())) {
+            *foundIndex = index;
+            return true;
         }
 
+        // If not found by ID, try find by partial name
+        return view().search.findFirst(input, availableProducts, foundIndex);
+    }
+
+    // The cart line of a product, by product ID
+    bool findCartItem(const string& id, ProductHandle* product, int* quantity) {
+        if (!activeCart || !view().ids.find(id, product)) return false;
+        shared_lock<shared_mutex> guard(accountsLock);
+        return activeCart->findItem(*product, quantity);
+    }
+
+    // Ask for a quantity and add the product to the active cart
+    void addToCartWithQuantity(ProductHandle index) {
         int quantity = 0;
         while (quantity <= 0) {
             cout << "Enter quantity: ";
@@ -698,79 +5699,62 @@ private:
         }
         cin.ignore(100, '\n'); 
 
-        currentActiveCart.addItem(*productPtr, quantity);
-        cout << "Successfully added " << productPtr->name << " to cart!" << endl;
+        string errorMessage;
+        if (!addToCart(index, quantity, &errorMessage)) {
+            cout << errorMessage << endl;
+            return;
+        }
+        cout << "Successfully added " << catalog().name(index) << " to cart!" << endl;
+    }
+
+    // Add product to cart from a list of available products (the whole catalog if null)
+    void addProductToCart(const ProductIndexSpan* availableProducts) {
+        cout << "\nAdd to Cart:" << endl;
+        if (availableProducts ? availableProducts->empty() : catalog().empty()) {
+            cout << "No products available to add." << endl;
+            return;
+        }
+  
+        cout << "Enter product ID or name to add (or 'exit' to cancel): ";
+        string input;
+        getline(cin, input);
+        if (toLower(input) == "exit") return;
+
+        ProductHandle index;
+        if (!findProduct(input, availableProducts, &index)) {
+            cout << "Product not found in the current list." << endl;
+            return;
+        }
+        addToCartWithQuantity(index);
     }
 
     // Add more products to cart, showing the full product list
     void addMoreProductToCart() {
         cout << "\nAdd more product to cart:" << endl;
-        displayProducts(products);
+        displayPage(ProductPager(catalog()));
 
         cout << "Enter product ID or name to add (or 'exit' to cancel): ";
         string input;
         getline(cin, input);
         if (toLower(input) == "exit") return;
 
-        const Product* productPtr = nullptr;
-
-        // Search by ID
-        for (const auto& product : products) {
-            if (product.id == input) { 
-                productPtr = &product; 
-                break; 
-            }
-        }
-
-        // Search by partial name if not found by ID
-        if (!productPtr) {
-            string lowerInput = toLower(input);
-            for (const auto& product : products) {
-                string lowerName = toLower(product.name);
-                bool found = false;
-                for (size_t i = 0; i + lowerInput.length() <= lowerName.length(); ++i) {
-                    if (lowerName.substr(i, lowerInput.length()) == lowerInput) {
-                        found = true;
-                        break;
-                    }
-                } 
-                if (found) { 
-                    productPtr = &product;
-                    break;
-                }
-            }
-        }
-
-        if (!productPtr) {
+        ProductHandle index;
+        if (!findProduct(input, nullptr, &index)) {
             cout << "Product not found." << endl;
             return;
         }
-
-        int quantity = 0;
-        while (quantity <= 0) {
-            cout << "Enter quantity: ";
-            if (!(cin >> quantity) || quantity <= 0) {
-                cout << "Invalid quantity. Please enter a positive number." << endl;
-                cin.clear();
-                cin.ignore(100, '\n');
-                quantity = 0;
-            }
-        }
-        cin.ignore(100, '\n');
-
-        currentActiveCart.addItem(*productPtr, quantity);
-        cout << "Successfully added " << productPtr->name << " to cart!" << endl;
+        addToCartWithQuantity(index);
     }
 
     // Allows editing of the current cart (add/remove/change quantity)
     void editCartOption() {
-        if (currentActiveCart.isEmpty()) {
+        if (cartIsEmpty()) {
             cout << "\nYour cart is empty, nothing to edit." << endl;
             return;
         }
 
         cout << "\n================\nUpdate Cart:\n================" << endl;
-        currentActiveCart.viewCart();
+        showCart();
 
         cout << "\n=========================\nChoose an option:\n";
         cout << "1. Add more product\n";
@@ -795,15 +5779,9 @@ private:
             string id;
             getline(cin, id);
 
-            auto items = currentActiveCart.getItems();
-            bool exists = false;
-            for (const auto& item : items) {
-                if (item.first.id == id) { 
-                exists = true; 
-                break; 
-                }
-            }
-            if (!exists) {
+            ProductHandle product;
+            int quantity;
+            if (!findCartItem(id, &product, &quantity)) {
                 cout << "Item not found in cart." << endl;
                 return;
             }
@@ -813,30 +5791,22 @@ private:
         cin >> ans;
         cin.ignore();
 
-        if (toupper(ans) == 'Y') {
-            currentActiveCart.removeItem(id);
-            cout << "Successfully removed item!" << endl;
-        } else {
+        string errorMessage;
+        if (toupper(ans) != 'Y') {
             cout << "Removal canceled." << endl;
+        } else if (!removeFromCart(id, &errorMessage)) {
+            cout << errorMessage << endl;
+        } else {
+            cout << "Successfully removed item!" << endl;
         }
     } else if (choice == 3) {
         cout << "Enter product ID to edit quantity: ";
         string id;
         getline(cin, id);
 
-        auto items = currentActiveCart.getItems();
-        bool exists = false;
+        ProductHandle product;
         int currentQuantity = 0;
-
-        for (const auto& item : items) {
-            if (item.first.id == id) { 
-                exists = true; 
-                currentQuantity = item.second; 
-                break; 
-            }
-        }
-
-        if (!exists) {
+        if (!findCartItem(id, &product, &currentQuantity)) {
             cout << "Item not found in cart." << endl;
             return;
         }
@@ -855,7 +5825,11 @@ private:
             }
             cin.ignore(100, '\n');
 
-            currentActiveCart.updateQuantity(id, newQuantity);
+            string errorMessage;
+            if (!changeCartQuantity(id, newQuantity, &errorMessage)) {
+                cout << errorMessage << endl;
+                return;
+            }
             cout << "Successfully adjusted quantity of item!" << endl;
         } else if (choice == 4) {
             cout << "Update cancelled." << endl;
@@ -865,59 +5839,8 @@ private:
         }
     }
 
-    // Checkout flow implementation
-    void checkoutOption() {
-        if (currentActiveCart.isEmpty()) {
-            cout << "\nYour cart is empty. Cannot proceed to checkout." << endl;
-            return;
-        }
-
-        cout << string(12, '=') << "\nCheckout:\n" << string(12, '=') << endl;
-        currentActiveCart.viewCart();
-
-        cout << "Continue checkout? (Y/N): ";
-        char cont;
-        cin >> cont;
-        cin.ignore();
-
-        if (toupper(cont) != 'Y') {
-            cout << "Checkout cancelled." << endl;
-            return;
-        }
-
-        // Collect buyer details
-        string name, phone;
-        cout << string(30, '=') << endl;
-        cout << "Enter your details to complete purchase:" << endl;
-        cout << "Name: ";
-        getline(cin, name);
-
-        // Validate phone number: digits only, 8 to 15 characters
-        while (true) {
-            cout << "Phone number: ";
-            getline(cin, phone);
-
-           bool isValidPhone = (phone.length() >= 8 && phone.length() <= 15);
-            for (char c : phone) {
-                if (!isdigit(c)) { 
-                    isValidPhone = false;
-                    break;
-                }
-            }
-            if (isValidPhone) {
-                break; 
-            } else {
-                cout << "Invalid phone number. Please enter digits only, minimum 8 and maximum 15 characters." << endl;
-            }
-        }
-
-        // Payment details collection
-        string paymentMethod;
-        string cardType;
-        string cardNumber;
-        string cardHolder;
-        string ccv;
-
+    // Ask for the payment method and card details until each one is valid
+    void askPaymentDetails(CheckoutRequest& request) {
         // Select payment method
         while (true) {
             cout << string(30, '-') << endl;
@@ -926,125 +5849,121 @@ private:
             getline(cin, pmChoice);
 
             if (pmChoice == "1") {
-                cardType = "Debit card";
+                request.cardType = "Debit card";
                 break;
             } else if (pmChoice == "2") {
-                cardType = "Credit card";
+                request.cardType = "Credit card";
                 break;
             } else {
                 cout << "Invalid choice. Please enter 1 or 2." << endl;
             }
         }
 
-        // Validate card number: digits only, length 13-19
+        // Validate card number: digits only, length 13-19, passing the Luhn check
         while (true) {
             cout << string(30, '-') << endl;
-            cout << cardType << " number: ";
-            getline(cin, cardNumber);
-            bool valid = (cardNumber.length() >= 13 && cardNumber.length() <= 19);
-            for (char c : cardNumber) {
-                if (!isdigit(c)) {
-                    valid = false;
-                    break;
-                }
-            }
-            if (valid) break;
-            cout << "Invalid card number. Please enter digits only, between 13 and 19 characters." << endl;
+            cout << request.cardType << " number: ";
+            getline(cin, request.cardNumber);
+            uint8_t problems = PaymentValidator::checkCardNumber(request.cardNumber);
+            if (!problems) break;
+            cout << PaymentValidator::describe(problems) << endl;
         }
 
         // Collect cardholder name
         cout << "Card holder name: ";
-        getline(cin, cardHolder);
+        getline(cin, request.cardHolder);
 
         // Validate CCV: 3 or 4 digits
         while (true) {
             cout << "CCV: ";
-            getline(cin, ccv);
-            bool valid = (ccv.length() == 3 || ccv.length() == 4);
-            for (char c : ccv) {
-                if (!isdigit(c)) {
-                    valid = false;
-                    break;
-                }
-            }
-            if (valid) break;
-            cout << "Invalid CCV. Please enter 3 or 4 digit number." << endl;
+            getline(cin, request.ccv);
+            uint8_t problems = PaymentValidator::checkCcv(request.ccv);
+            if (!problems) break;
+            cout << PaymentValidator::describe(problems) << endl;
         }
 
         // Validate expiration date MM/YY format and logical checks
-        string expDate;
         while (true) {
             cout << "Expiration date (MM/YY): ";
-            getline(cin, expDate);
-
-            // Check basic format: must be 5 characters with '/' at position 2 (e.g., "06/25")
-            if (expDate.length() == 5 && expDate[2] == '/') {
-                string monthStr = expDate.substr(0, 2); // Extract month part
-                string yearStr = expDate.substr(3, 2); // Extract year part (last two digits)
-                int month = 0;
-                int year = 0;
-
-                try {
-                    // Convert strings to integers
-                    month = stoi(monthStr);
-                    year = stoi(yearStr) + 2000; // Convert to full year (e.g., "25" -> 2025)
-
-                } catch (...) {
-                    cout << "Invalid numbers in expiration date." << endl;
-                    continue;
-                }
+            getline(cin, request.expiry);
+            uint8_t problems = PaymentValidator::checkExpiry(request.expiry);
+            if (!problems) break;
+            cout << PaymentValidator::describe(problems) << endl;
+        }
+    }
 
-                // Check that month is within valid range
-                if (month >= 1 && month <= 12) {
+    // Checkout flow implementation
+    void checkoutOption() {
+        if (cartIsEmpty()) {
+            cout << "\nYour cart is empty. Cannot proceed to checkout." << endl;
+            return;
+        }
 
-                    // Get current year for validation
-                    time_t now = time(0);
-                    tm* ltm = localtime(&now);
-                    int currentYear = 1900 + ltm->tm_year;
-                    if (year >= currentYear) {
+        // Products retired since they were added cannot be bought any more
+        for (const string& name : dropRetiredItems()) {
+            cout << name << " is no longer available and was removed from your cart." << endl;
+        }
+        if (cartIsEmpty()) {
+            cout << "\nYour cart is empty. Cannot proceed to checkout." << endl;
+            return;
+        }
 
-                        break;
-                    } else {
-                        cout << "Invalid expiration year. Please enter a valid year." << endl;
-                        }
-                    } else {
-                        cout << "Invalid month. Please enter a month between 01 and 12." << endl;
-                        }
-                    } else {
-                        cout << "Invalid format. Please enter in MM/YY format." << endl;
-                        }
-                    }
+        cout << string(12, '=') << "\nCheckout:\n" << string(12, '=') << endl;
+        showCart();
 
-        // Prepare purchase details for order
-        vector<PurchasedItem> purchasedItems;
-        double totalPrice = 0;
-        int totalQuantity = 0;
+        cout << "Continue checkout? (Y/N): ";
+        char cont;
+        cin >> cont;
+        cin.ignore();
 
-        for (const auto& item : currentActiveCart.getItems()) {
-            purchasedItems.push_back({item.first, item.second, item.first.price});
-            totalPrice += item.first.price * item.second;
-            totalQuantity += item.second;
+        if (toupper(cont) != 'Y') {
+            cout << "Checkout cancelled." << endl;
+            return;
         }
 
-        // Generate order number (using current time)
-        time_t now = time(0);
-        long long orderNumber = static_cast<long long>(now);
+        // Collect buyer details
+        CheckoutRequest request;
+        cout << string(30, '=') << endl;
+        cout << "Enter your details to complete purchase:" << endl;
+        cout << "Name: ";
+        getline(cin, request.buyerName);
 
-        // Format payment method display string
-        string paymentMethodDisplay = cardType + " ending in ";
-        if (cardNumber.length() >= 4) {
-            paymentMethodDisplay += cardNumber.substr(cardNumber.length() - 4);
-        } else {
-            paymentMethodDisplay += cardNumber;
+        // Validate phone number: digits only, 8 to 15 characters
+        while (true) {
+            cout << "Phone number: ";
+            getline(cin, request.buyerPhone);
+            uint8_t problems = PaymentValidator::checkPhone(request.buyerPhone);
+            if (!problems) break;
+            cout << PaymentValidator::describe(problems) << endl;
         }
 
-        // Create new order and add it to user's purchase history
-        Order newOrder(orderNumber, now, name, phone, paymentMethodDisplay, purchasedItems, totalPrice, totalQuantity);
-        if (currentUser)
-            currentUser->addOrder(newOrder);
+        askPaymentDetails(request);
+
+        // Hand the order to the checkout pipeline and wait for it to be placed
+        CheckoutResult result;
+        while (true) {
+            result = placeOrder(request);
+            if (result.placed) break;
+            cout << "Your order could not be placed: " << result.errorMessage << endl;
+            if (result.chargeUncertain) { // a retry would only be told the same
+                cout << "Your cart was kept." << endl;
+                return;
+            }
+            // Sending the same card again would only be declined again
+            cout << "Pay with different card details? (Y/N): ";
+            char again;
+            cin >> again;
+            cin.ignore();
+            if (toupper(again) != 'Y') {
+                cout << "Checkout cancelled. Your cart was kept." << endl;
+                return;
+            }
+            askPaymentDetails(request);
+            request.idempotencyKey.clear(); // a new payment, not a retry of the declined one
+        }
+        if (result.repeated) cout << "This order had already been placed; here is its receipt." << endl;
 
-        printReceipt(newOrder);
-        currentActiveCart.clearCart();
+        printReceipt(result.order);
 
         cout << "Your order was successfully placed! You can now proceed to download your items." << endl;
         cout << "If you want to view and download your purchases, just visit your Purchase History page." << endl;
@@ -1077,14 +5996,14 @@ private:
 
             for (int i = order.purchasedItems.size() - 1; i >= 0; --i) {
                 const PurchasedItem& pi = order.purchasedItems[i];
-                cout << "[Download Here] " << pi.product.id << " - " << pi.product.name
+                cout << "[Download Here] " << catalog().id(pi.product) << " - " << catalog().name(pi.product)
                     << " - Quantity: " << pi.quantity
-                    << " - Price: Php. " << fixed << setprecision(2) << pi.priceAtPurchase * pi.quantity << endl;
+                    << " - Price: Php. " << pi.priceAtPurchase * pi.quantity << endl;
     }
 
             cout << string(18, '-') << endl;
             cout << "Total Items: " << order.totalQuantity << endl;
-            cout << "Total Price: Php. " << fixed << setprecision(2) << order.totalPrice << endl;
+            cout << "Total Price: Php. " << order.totalPrice << endl;
             cout << string(42, '=') << "\n" << endl;
     }
 
@@ -1095,21 +6014,831 @@ private:
                 return;
         }
             cout << "\nPurchase History for " << currentUser->email << ":" << endl;
-            if (currentUser->purchaseHistory.empty()) {
-            cout << "No purchase history found." << endl;
-            return;
+            readHistory([this](const vector<Order>& orders) {
+                if (orders.empty()) {
+                    cout << "No purchase history found." << endl;
+                    return;
+                }
+
+                // Print receipts for each order in reverse chronological order
+                for (int i = orders.size() - 1; i >= 0; --i) {
+                    printReceipt(orders[i]);
+                }
+            });
+    }
+};
+
+// Runs a script of store commands without a terminal, for replaying traffic and load tests.
+// One command per line, words separated by spaces or tabs, '#' starts a comment:
+//   login <email> <password>          signup <email> <password>        logout
+//   search <term...>                  add <quantity> <product ID or name...>
+//   remove <product ID>               quantity <product ID> <quantity>
+//   cart                              history
+//   checkout <phone> <card number> <ccv> <MM/YY> [idempotency key]
+// The script is scanned in place without copying lines, and nothing is printed per
+// command. Checkouts do not wait for their orders, so payments overlap; their outcomes are
+// collected as they finish and at the end. Failed commands are counted, and the first few
+// are reported with their line numbers.
+class BatchRunner {
+private:
+    enum Command { LOGIN, SIGNUP, LOGOUT, SEARCH, ADD, REMOVE, QUANTITY, CART, HISTORY, CHECKOUT, COMMAND_COUNT };
+    static constexpr const char* COMMAND_NAMES[COMMAND_COUNT] = {"login", "signup", "logout", "search", "add",
+                                                                 "remove", "quantity", "cart", "history", "checkout"};
+    static const size_t MAX_REPORTED_FAILURES = 20;
+    static const size_t MAX_PENDING_ORDERS = 4096;
+
+    struct CommandStats {
+        uint64_t runs = 0;
+        uint64_t failures = 0;
+        uint64_t nanoseconds = 0;
+    };
+
+    Application& app;
+    ostream& report;
+    array<CommandStats, COMMAND_COUNT> stats;
+    size_t failuresReported = 0;
+    uint64_t unknownCommands = 0;
+    uint64_t ordersPlaced = 0;
+    uint64_t retriesAnswered = 0; // checkouts answered with an earlier attempt's order
+    deque<pair<size_t, future<CheckoutResult>>> pendingOrders; // (script line, result)
+    uint64_t checksum = 0; // search hits and cart totals, so the work cannot be skipped
+
+    static string_view nextWord(string_view& text) {
+        size_t start = 0;
+        while (start < text.size() && (text[start] == ' ' || text[start] == '\t')) ++start;
+        size_t end = start;
+        while (end < text.size() && text[end] != ' ' && text[end] != '\t') ++end;
+        string_view word = text.substr(start, end - start);
+        text.remove_prefix(end);
+        return word;
+    }
+
+    // The rest of the line without surrounding blanks
+    static string_view rest(string_view text) {
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+        return text;
+    }
+
+    static bool parseCount(string_view word, int* value) {
+        const char* end = word.data() + word.size();
+        return !word.empty() && from_chars(word.data(), end, *value).ptr == end;
+    }
+
+    void fail(Command command, size_t line, string_view reason) {
+        ++stats[command].failures;
+        if (failuresReported++ < MAX_REPORTED_FAILURES) {
+            report << "line " << line << ": " << COMMAND_NAMES[command] << " failed: " << reason << "\n";
+        }
+    }
+
+    void collectOrder() {
+        CheckoutResult result = pendingOrders.front().second.get();
+        if (result.placed && result.repeated) ++retriesAnswered;
+        else if (result.placed) ++ordersPlaced;
+        else fail(CHECKOUT, pendingOrders.front().first, result.errorMessage);
+        pendingOrders.pop_front();
+    }
+
+    bool needsUser(Command command, size_t line) {
+        if (app.loggedInUser()) return true;
+        fail(command, line, "no user logged in");
+        return false;
+    }
+
+    void execute(Command command, string_view arguments, size_t line) {
+        string errorMessage;
+        switch (command) {
+        case LOGIN: {
+            string email(nextWord(arguments)), password(nextWord(arguments));
+            if (!app.logInUser(email, password)) fail(command, line, "invalid email or password");
+            break;
+        }
+        case SIGNUP: {
+            string email(nextWord(arguments)), password(nextWord(arguments));
+            if (!app.signUpUser(email, password, &errorMessage)) fail(command, line, errorMessage);
+            break;
+        }
+        case LOGOUT:
+            if (needsUser(command, line)) app.logOut(false);
+            break;
+        case SEARCH:
+            checksum += app.searchCatalog(string(rest(arguments))).size();
+            break;
+        case ADD: {
+            int quantity = 0;
+            if (!parseCount(nextWord(arguments), &quantity)) {
+                fail(command, line, "expected: add <quantity> <product>");
+            } else if (needsUser(command, line) && !app.addToCart(string(rest(arguments)), quantity, &errorMessage)) {
+                fail(command, line, errorMessage);
+            }
+            break;
+        }
+        case REMOVE:
+            if (needsUser(command, line) && !app.removeFromCart(string(nextWord(arguments)), &errorMessage))
+                fail(command, line, errorMessage);
+            break;
+        case QUANTITY: {
+            string id(nextWord(arguments));
+            int quantity = 0;
+            if (!parseCount(nextWord(arguments), &quantity)) {
+                fail(command, line, "expected: quantity <product ID> <quantity>");
+            } else if (needsUser(command, line) && !app.changeCartQuantity(id, quantity, &errorMessage)) {
+                fail(command, line, errorMessage);
+            }
+            break;
+        }
+        case CART:
+            if (needsUser(command, line)) {
+                checksum += app.readCart([](const ShoppingCart& cart) { return cart.totalItems() + cart.totalPrice().centavos(); });
+            }
+            break;
+        case HISTORY:
+            if (needsUser(command, line)) checksum += app.readHistory([](const vector<Order>& orders) { return orders.size(); });
+            break;
+        case CHECKOUT: {
+            if (!needsUser(command, line)) break;
+            CheckoutRequest request;
+            request.buyerName = app.loggedInUser()->email;
+            request.buyerPhone = string(nextWord(arguments));
+            request.cardType = "Debit card";
+            request.cardNumber = string(nextWord(arguments));
+            request.cardHolder = request.buyerName;
+            request.ccv = string(nextWord(arguments));
+            request.expiry = string(nextWord(arguments));
+            request.idempotencyKey = string(nextWord(arguments));
+            app.dropRetiredItems(); // as at the checkout menu, so one retired line cannot block the rest
+            // A retry is answered with its first attempt's result even though that attempt
+            // emptied the cart; only a checkout the store has not seen needs items, which the
+            // processor checks
+            if (request.idempotencyKey.empty() && app.readCart([](const ShoppingCart& cart) { return cart.isEmpty(); })) {
+                fail(command, line, "the cart is empty");
+                break;
+            }
+            if (pendingOrders.size() >= MAX_PENDING_ORDERS) collectOrder();
+            pendingOrders.emplace_back(line, app.startOrder(move(request)));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    static bool commandNamed(string_view word, Command* command) {
+        for (int i = 0; i < COMMAND_COUNT; ++i) {
+            if (word == COMMAND_NAMES[i]) {
+                *command = Command(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    BatchRunner(Application& app, ostream& report) : app(app), report(report) {}
+
+    // Run every command in the script, then wait for the orders it placed
+    void run(string_view script) {
+        size_t lineNumber = 0;
+        while (!script.empty()) {
+            size_t end = script.find('\n');
+            string_view line = script.substr(0, end);
+            script.remove_prefix(end == string_view::npos ? script.size() : end + 1);
+            ++lineNumber;
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+
+            string_view arguments = line;
+            string_view word = nextWord(arguments);
+            if (word.empty() || word[0] == '#') continue;
+            Command command;
+            if (!commandNamed(word, &command)) {
+                if (unknownCommands++ < MAX_REPORTED_FAILURES) report << "line " << lineNumber << ": unknown command " << word << "\n";
+                continue;
+            }
+
+            auto started = chrono::steady_clock::now();
+            app.refreshCatalog(); // like the menus, pick up catalog changes between commands
+            execute(command, arguments, lineNumber);
+            stats[command].nanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+            ++stats[command].runs;
+        }
+        while (!pendingOrders.empty()) collectOrder();
+    }
+
+    // Per-command counts, failures and throughput
+    void printSummary(double elapsedMilliseconds) {
+        if (failuresReported > MAX_REPORTED_FAILURES) {
+            report << "(" << failuresReported - MAX_REPORTED_FAILURES << " more failures not shown)\n";
         }
+        uint64_t total = 0, failures = 0;
+        report << "command        runs   failed      ops/s   avg us\n";
+        for (int i = 0; i < COMMAND_COUNT; ++i) {
+            const CommandStats& command = stats[i];
+            total += command.runs;
+            failures += command.failures;
+            if (command.runs == 0) continue;
+            double seconds = command.nanoseconds / 1e9;
+            report << left << setw(10) << COMMAND_NAMES[i] << right << setw(9) << command.runs << setw(9)
+                   << command.failures << fixed << setprecision(0) << setw(11) << command.runs / max(seconds, 1e-9)
+                   << setprecision(2) << setw(9) << command.nanoseconds / 1000.0 / command.runs << "\n";
+        }
+        report << fixed << setprecision(0) << total << " commands (" << failures << " failed, " << unknownCommands
+               << " unknown) in " << elapsedMilliseconds << " ms: " << total / max(elapsedMilliseconds / 60000, 1e-9)
+               << " per minute; " << ordersPlaced << " orders placed, " << retriesAnswered
+               << " retries answered with an earlier order\n";
+    }
 
-        // Print receipts for each order in reverse chronological order
-        for (int i = currentUser->purchaseHistory.size() - 1; i >= 0; --i) {
-            printReceipt(currentUser->purchaseHistory[i]);
+    bool anyFailed() const {
+        if (unknownCommands) return true;
+        for (const CommandStats& command : stats) {
+            if (command.failures) return true;
         }
+        return false;
     }
 };
 
+// Build a synthetic catalog of the given size for benchmarks
+vector<Product> syntheticProducts(uint32_t count) {
+    const char* words[] = {"Canva", "Template", "Resume", "Planner", "Ebook", "Course", "Guide", "Photo",
+                           "Vector", "Font", "Icon", "Preset", "Plugin", "Theme", "Music", "Sound",
+                           "Podcast", "Logo", "Brand", "Marketing", "Study", "Printable", "Bundle", "Pack"};
+    mt19937 rng(42);
+    vector<Product> products;
+    products.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        string name;
+        int wordCount = 2 + rng() % 3;
+        for (int w = 0; w < wordCount; ++w) {
+            if (w) name += ' ';
+            name += words[rng() % (sizeof(words) / sizeof(words[0]))];
+        }
+        char id[16];
+        snprintf(id, sizeof(id), "%07u", i);
+        products.emplace_back(id, name, Money::fromCentavos(500 + rng() % 20000), KNOWN_CATEGORIES[rng() % size(KNOWN_CATEGORIES)]);
+    }
+    return products;
+}
+
+// Time a function and return the elapsed milliseconds
+template <typename Function>
+double timeMilliseconds(Function function) {
+    auto start = chrono::steady_clock::now();
+    function();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// The built-in catalog, for the benchmarks that place orders
+void loadSeedCatalog(Catalog* catalog) {
+    string errorMessage;
+    catalog->loadStatic(SEED_CATALOG_IMAGE.data(), SEED_CATALOG_IMAGE.size(), &SEED_ID_HASH, &errorMessage);
+}
+
+// Accounts buyer0@gmail.com, buyer1@gmail.com, ... to place benchmark orders with
+vector<User*> addBenchmarkBuyers(Auth& auth, size_t count) {
+    vector<User*> buyers;
+    for (size_t i = 0; i < count; ++i) {
+        string email = "buyer" + to_string(i) + "@gmail.com";
+        auth.addUser(email, "benchmark");
+        buyers.push_back(auth.findUserByEmail(email));
+    }
+    return buyers;
+}
+
+// A checkout of `lines` by `buyer` whose buyer and card details all pass validation
+CheckoutRequest benchmarkCheckout(User* buyer, const Catalog& catalog, vector<CartLine> lines) {
+    CheckoutRequest request;
+    request.user = buyer;
+    request.catalog = &catalog;
+    request.lines = move(lines);
+    request.buyerName = "Benchmark Buyer";
+    request.buyerPhone = "09171234567";
+    request.cardType = "Debit card";
+    request.cardNumber = "4111111111111111";
+    request.cardHolder = "Benchmark Buyer";
+    request.ccv = "123";
+    request.expiry = "12/99";
+    return request;
+}
+
+// Compare the original toLower/substr search loop against the substring kernels
+void runSearchBenchmark(uint32_t productCount) {
+    string errorMessage;
+    Catalog catalog;
+    catalog.loadProducts(syntheticProducts(productCount), &errorMessage);
+
+    string pool;
+    for (uint32_t i = 0; i < catalog.size(); ++i) {
+        pool += catalog.name(i);
+        pool += '\0';
+    }
+    const char* queries[] = {"te", "plan", "resume", "sound pack", "zzz"};
+    const int rounds = 5;
+
+    cout << "Search benchmark: " << productCount << " products, " << pool.size() / 1024 << " KiB of names" << endl;
+
+    // Original loop: lowercase copy of every name, then a substr per position
+    size_t legacyHits = 0;
+    double legacy = timeMilliseconds([&] {
+        for (int r = 0; r < rounds; ++r) {
+            for (const char* query : queries) {
+                string lowerTerm = ProductSearchEngine::normalize(query);
+                for (uint32_t i = 0; i < catalog.size(); ++i) {
+                    string lowerName = ProductSearchEngine::normalize(string(catalog.name(i)));
+                    for (size_t j = 0; j + lowerTerm.length() <= lowerName.length(); ++j) {
+                        if (lowerName.substr(j, lowerTerm.length()) == lowerTerm) {
+                            ++legacyHits;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    });
+    cout << "  " << left << setw(8) << "legacy" << right << fixed << setprecision(2)
+         << setw(10) << legacy / rounds << " ms/round  (" << legacyHits / rounds << " hits)" << endl;
+
+    vector<pair<string, FindIgnoreCaseFunction>> kernels = {{"scalar", findIgnoreCaseScalar}};
+#ifdef BROKESTORE_X86_SIMD
+    kernels.push_back({"sse2", findIgnoreCaseSse2});
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", findIgnoreCaseAvx2});
+#endif
+    for (const auto& kernel : kernels) {
+        size_t hits = 0;
+        double elapsed = timeMilliseconds([&] {
+            for (int r = 0; r < rounds; ++r) {
+                for (const char* query : queries) {
+                    string lowerTerm = ProductSearchEngine::normalize(query);
+                    size_t position = 0;
+                    while (position < pool.size()) {
+                        size_t hit = kernel.second(pool.data() + position, pool.size() - position,
+                                                   lowerTerm.data(), lowerTerm.length());
+                        if (hit == string_view::npos) break;
+                        ++hits;
+                        position = pool.find('\0', position + hit) + 1; // skip to the next name
+                    }
+                }
+            }
+        });
+        double megabytes = double(pool.size()) * (sizeof(queries) / sizeof(queries[0])) / (1024 * 1024);
+        cout << "  " << left << setw(8) << kernel.first << right << setw(10) << elapsed / rounds
+             << " ms/round  (" << hits / rounds << " hits, " << setprecision(0)
+             << megabytes * rounds / (elapsed / 1000) << " MB/s)" << setprecision(2) << endl;
+    }
+}
+
+// Sign up and log in accounts from several threads at once, and race sign-ups of the same emails
+void runAuthBenchmark(size_t accountCount, unsigned maxThreads) {
+    cout << "Auth benchmark: " << accountCount << " accounts, up to " << maxThreads << " threads" << endl;
+
+    vector<string> emails;
+    emails.reserve(accountCount);
+    for (size_t i = 0; i < accountCount; ++i) emails.push_back("user" + to_string(i) + "@gmail.com");
+
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+        Auth auth;
+        atomic<size_t> failures(0);
+        auto runThreads = [&](auto work) {
+            vector<thread> workers;
+            for (unsigned t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    for (size_t i = t; i < accountCount; i += threads) work(i);
+                });
+            }
+            for (auto& worker : workers) worker.join();
+        };
+        double signUpTime = timeMilliseconds([&] {
+            runThreads([&](size_t i) {
+                string errorMessage;
+                if (!auth.signUp(emails[i], "password123", &errorMessage)) ++failures;
+            });
+        });
+        double logInTime = timeMilliseconds([&] {
+            runThreads([&](size_t i) {
+                if (!auth.logIn(emails[i], "password123")) ++failures;
+            });
+        });
+        cout << "  " << setw(3) << threads << " threads: " << fixed << setprecision(0)
+             << setw(10) << accountCount / (signUpTime / 1000) << " sign-ups/s"
+             << setw(12) << accountCount / (logInTime / 1000) << " logins/s"
+             << (failures ? "  (" + to_string(failures) + " failures)" : string()) << endl;
+    }
+
+    // Every thread tries to register every email; each must succeed exactly once
+    size_t raceCount = min<size_t>(accountCount, 100000);
+    Auth auth;
+    atomic<size_t> created(0);
+    vector<thread> workers;
+    for (unsigned t = 0; t < maxThreads; ++t) {
+        workers.emplace_back([&] {
+            string errorMessage;
+            for (size_t i = 0; i < raceCount; ++i) {
+                if (auth.signUp(emails[i], "password123", &errorMessage)) ++created;
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    cout << "  Duplicate sign-up race: " << created << " of " << raceCount << " accounts created "
+         << (created == raceCount ? "(ok)" : "(WRONG)") << endl;
+}
+
+// Draw order numbers from several threads at once and check that none repeats
+void runOrderIdBenchmark(size_t idCount, unsigned maxThreads) {
+    cout << "Order ID benchmark: " << idCount << " IDs, up to " << maxThreads << " threads" << endl;
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+        OrderIdGenerator generator(1);
+        vector<long long> ids(idCount);
+        double elapsed = timeMilliseconds([&] {
+            parallelFor(idCount, threads, [&](size_t i) { ids[i] = generator.next(); });
+        });
+        sort(ids.begin(), ids.end());
+        bool unique = adjacent_find(ids.begin(), ids.end()) == ids.end();
+        cout << "  " << setw(3) << threads << " threads: " << fixed << setprecision(0)
+             << setw(12) << idCount / (elapsed / 1000) << " IDs/s" << (unique ? "" : "  (DUPLICATES)") << endl;
+    }
+}
+
+// Commit orders to a scratch journal from several threads, for a range of batch windows
+void runJournalBenchmark(size_t orderCount, unsigned threads) {
+    string errorMessage;
+    Catalog catalog;
+    loadSeedCatalog(&catalog);
+    vector<PurchasedItem> items = {{0, 2, catalog.price(0)}, {7, 1, catalog.price(7)}};
+    Order order(1, time(0), "Benchmark Buyer", "09171234567", "Debit card ending in 1111", items,
+                catalog.price(0) * 2 + catalog.price(7), 3);
+    string record = encodeOrderRecord("bench@gmail.com", order, catalog);
+    const string path = "bench-orders.journal";
+
+    cout << "Journal benchmark: " << orderCount << " orders from " << threads << " threads, "
+         << record.size() << "-byte records" << endl;
+    for (int windowMicroseconds : {0, 100, 1000, 5000}) {
+        remove(path.c_str());
+        OrderJournal journal;
+        if (!journal.open(path, JournalPosition(), [](string_view) {}, &errorMessage)) {
+            cout << "  " << errorMessage << endl;
+            return;
+        }
+        journal.setBatchWindow(chrono::microseconds(windowMicroseconds));
+        atomic<size_t> failures(0);
+        double elapsed = timeMilliseconds([&] {
+            parallelFor(threads, threads, [&](size_t t) {
+                string error;
+                for (size_t i = t; i < orderCount; i += threads) {
+                    if (!journal.commit(record, &error)) ++failures;
+                }
+            });
+        });
+        uint64_t batches = journal.batches();
+        cout << "  window " << setw(5) << windowMicroseconds << " us: " << fixed << setprecision(0)
+             << setw(9) << orderCount / (elapsed / 1000) << " orders/s, " << batches << " fsyncs ("
+             << setprecision(1) << double(orderCount) / max<uint64_t>(batches, 1) << " orders each)"
+             << (failures ? "  (" + to_string(failures) + " failures)" : string()) << endl;
+    }
+    remove(path.c_str());
+}
+
+// Place orders through the serial and the pipelined checkout, journaling to a scratch file
+void runCheckoutBenchmark(size_t orderCount, unsigned workers) {
+    string errorMessage;
+    Catalog catalog;
+    loadSeedCatalog(&catalog);
+    Auth auth;
+    vector<User*> buyers = addBenchmarkBuyers(auth, 64);
+    auto makeRequest = [&](size_t i) {
+        return benchmarkCheckout(buyers[i % buyers.size()], catalog, {{0, 2, catalog.price(0)}, {7, 1, catalog.price(7)}});
+    };
+    const string path = "bench-checkout.journal";
+
+    cout << "Checkout benchmark: " << orderCount << " orders, " << workers << " pipeline workers" << endl;
+    for (bool pipelined : {false, true}) {
+        remove(path.c_str());
+        OrderIdGenerator orderIds(1);
+        OrderJournal journal;
+        if (!journal.open(path, JournalPosition(), [](string_view) {}, &errorMessage)) {
+            cout << "  " << errorMessage << endl;
+            return;
+        }
+        CheckoutServices services;
+        services.orderIds = &orderIds;
+        services.journal = &journal;
+        PipelinedCheckout::Config config;
+        config.workers = workers;
+        unique_ptr<CheckoutStrategy> strategy;
+        if (pipelined) strategy.reset(new PipelinedCheckout(services, config));
+        else strategy.reset(new StandardCheckout(services));
+
+        size_t placed = 0;
+        double elapsed = timeMilliseconds([&] {
+            if (!pipelined) {
+                for (size_t i = 0; i < orderCount; ++i) placed += strategy->submit(makeRequest(i)).get().placed;
+                return;
+            }
+            vector<future<CheckoutResult>> results;
+            results.reserve(orderCount);
+            for (size_t i = 0; i < orderCount; ++i) results.push_back(strategy->submit(makeRequest(i)));
+            for (auto& result : results) placed += result.get().placed;
+        });
+        cout << "  " << (pipelined ? "pipelined" : "standard ") << ": " << fixed << setprecision(0) << setw(9)
+             << orderCount / (elapsed / 1000) << " orders/s, " << journal.batches() << " fsyncs"
+             << (placed != orderCount ? "  (" + to_string(orderCount - placed) + " not placed)" : string()) << endl;
+        if (pipelined) {
+            cout << "    stage       processed  avg wait us  avg service us  max service us" << endl;
+            for (const CheckoutStageStats& stage : static_cast<PipelinedCheckout&>(*strategy).stageStats()) {
+                cout << "    " << left << setw(10) << stage.name << right << setw(11) << stage.processed
+                     << setprecision(1) << setw(13) << stage.averageWaitMicroseconds << setw(16)
+                     << stage.averageServiceMicroseconds << setw(16) << stage.maxServiceMicroseconds << endl;
+            }
+        }
+    }
+    remove(path.c_str());
+}
+
+// Place orders through the pipelined checkout against the gateway simulator, allowing more
+// and more payment calls to overlap
+void runPaymentBenchmark(size_t orderCount, size_t maxConcurrent) {
+    string errorMessage;
+    Catalog catalog;
+    loadSeedCatalog(&catalog);
+    Auth auth;
+    User* buyer = addBenchmarkBuyers(auth, 1)[0];
+
+    PaymentGatewaySimulator::Config gatewayConfig;
+    gatewayConfig.minLatency = chrono::microseconds(5000);
+    gatewayConfig.meanExtraLatency = chrono::microseconds(15000);
+    gatewayConfig.unavailableRate = 0.05;
+    gatewayConfig.dropRate = 0.02;
+    gatewayConfig.declineRate = 0.01;
+    PaymentClient::Config clientConfig;
+    clientConfig.timeout = chrono::microseconds(100000);
+    clientConfig.retryBackoff = chrono::microseconds(10000);
+    const string path = "bench-payments.journal";
+
+    cout << "Payment benchmark: " << orderCount << " orders; gateway latency "
+         << gatewayConfig.minLatency.count() / 1000 << " ms + ~" << gatewayConfig.meanExtraLatency.count() / 1000
+         << " ms, " << gatewayConfig.unavailableRate * 100 << "% busy, " << gatewayConfig.dropRate * 100
+         << "% lost, " << gatewayConfig.declineRate * 100 << "% declined" << endl;
+    for (size_t limit = 4; limit <= maxConcurrent; limit *= 4) {
+        remove(path.c_str());
+        OrderIdGenerator orderIds(1);
+        OrderJournal journal;
+        if (!journal.open(path, JournalPosition(), [](string_view) {}, &errorMessage)) {
+            cout << "  " << errorMessage << endl;
+            return;
+        }
+        PaymentGatewaySimulator gateway(gatewayConfig);
+        clientConfig.maxConcurrent = limit;
+        PaymentClient payments(gateway, clientConfig);
+        CheckoutServices services;
+        services.orderIds = &orderIds;
+        services.journal = &journal;
+        services.payments = &payments;
+        PipelinedCheckout checkout(services);
+
+        size_t placed = 0;
+        double elapsed = timeMilliseconds([&] {
+            vector<future<CheckoutResult>> results;
+            results.reserve(orderCount);
+            for (size_t i = 0; i < orderCount; ++i) {
+                results.push_back(checkout.submit(
+                    benchmarkCheckout(buyer, catalog, {{0, 2, catalog.price(0)}, {7, 1, catalog.price(7)}})));
+            }
+            for (auto& result : results) placed += result.get().placed;
+        });
+        PaymentClient::Stats stats = payments.stats();
+        CheckoutStageStats authorize = checkout.stageStats()[CHECKOUT_AUTHORIZE];
+        cout << "  " << setw(4) << limit << " concurrent: " << fixed << setprecision(0) << setw(7)
+             << orderCount / (elapsed / 1000) << " orders/s, " << placed << " placed, " << stats.declined
+             << " declined, " << stats.failed << " failed; " << stats.attempts << " attempts, " << stats.retries
+             << " retries, " << stats.timeouts << " timeouts; authorize avg " << setprecision(1)
+             << authorize.averageServiceMicroseconds / 1000 << " ms" << endl;
+    }
+    remove(path.c_str());
+}
+
+// Submit checkouts where some are retried, right away or much later, through the
+// deduplicating checkout, and count how many orders were placed twice
+void runIdempotencyBenchmark(size_t orderCount, size_t capacity) {
+    Catalog catalog;
+    loadSeedCatalog(&catalog);
+    Auth auth;
+    vector<User*> buyers = addBenchmarkBuyers(auth, 64);
+
+    // Every order is sent once; a fifth are sent again at once, while the first attempt is
+    // still running, and a fifth again at a random later point
+    mt19937_64 random(7);
+    vector<pair<size_t, size_t>> sends; // (when, order)
+    for (size_t i = 0; i < orderCount; ++i) {
+        sends.push_back({i * 8, i});
+        unsigned roll = random() % 5;
+        if (roll == 0) sends.push_back({i * 8 + 1, i});
+        if (roll == 1) sends.push_back({i * 8 + random() % (capacity * 16 + 1), i}); // up to 2 cache-fulls later
+    }
+    sort(sends.begin(), sends.end());
+
+    PaymentGatewaySimulator::Config gatewayConfig;
+    gatewayConfig.minLatency = chrono::microseconds(1000);
+    gatewayConfig.meanExtraLatency = chrono::microseconds(2000);
+    gatewayConfig.unavailableRate = 0;
+    gatewayConfig.dropRate = 0;
+    PaymentGatewaySimulator gateway(gatewayConfig);
+    PaymentClient::Config clientConfig;
+    clientConfig.maxConcurrent = 256;
+    PaymentClient payments(gateway, clientConfig);
+    OrderIdGenerator orderIds(1);
+    CheckoutServices services;
+    services.orderIds = &orderIds;
+    services.payments = &payments;
+    IdempotentCheckout checkout(unique_ptr<CheckoutStrategy>(new PipelinedCheckout(services)), capacity);
+
+    size_t placed = 0, repeated = 0;
+    double elapsed = timeMilliseconds([&] {
+        vector<future<CheckoutResult>> results;
+        results.reserve(sends.size());
+        for (const auto& send : sends) {
+            ProductHandle product = ProductHandle(send.second % catalog.size());
+            CheckoutRequest request = benchmarkCheckout(buyers[send.second % buyers.size()], catalog,
+                                                        {{product, 1, catalog.price(product)}});
+            request.idempotencyKey = "order-" + to_string(send.second);
+            results.push_back(checkout.submit(move(request)));
+        }
+        for (auto& result : results) {
+            CheckoutResult outcome = result.get();
+            if (outcome.repeated) ++repeated;
+            else if (outcome.placed) ++placed;
+        }
+    });
+    CheckoutDedupCache::Stats stats = checkout.cacheStats();
+    cout << "Idempotency benchmark: " << orderCount << " orders, " << sends.size() - orderCount
+         << " retries, cache of " << stats.capacity << " keys" << endl;
+    cout << "  " << fixed << setprecision(0) << sends.size() / (elapsed / 1000) << " checkouts/s; "
+         << placed << " orders placed (" << (placed > orderCount ? placed - orderCount : 0) << " duplicates), "
+         << repeated << " retries answered from the cache" << endl;
+    cout << "  cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions
+         << " evictions, " << stats.size << " keys held" << endl;
+}
+
+// Check synthetic payment records one at a time and in batches, and compare the answers
+void runValidationBenchmark(size_t recordCount) {
+    mt19937_64 random(42);
+    auto digits = [&](size_t length) {
+        string text(length, '0');
+        for (char& c : text) c = char('0' + random() % 10);
+        return text;
+    };
+    vector<string> phones, cards, ccvs, expiries;
+    for (size_t i = 0; i < recordCount; ++i) {
+        string card = digits(13 + random() % 7);
+        card.back() = '0';
+        for (char check = '0'; check <= '9' && !PaymentValidator::luhnValid(card); ++check) card.back() = check;
+        string expiry = to_string(101 + random() % 12).substr(1) + "/" +
+                        to_string(100 + (PaymentValidator::currentYear() - 1 + random() % 8) % 100).substr(1);
+        phones.push_back(digits(8 + random() % 8));
+        cards.push_back(card);
+        ccvs.push_back(digits(3 + random() % 2));
+        expiries.push_back(expiry);
+        switch (random() % 10) { // some records have a bad field; one in eight has also expired
+        case 0: phones.back()[random() % phones.back().size()] = 'x'; break;
+        case 1: cards.back()[random() % cards.back().size()] ^= 1; break;
+        case 2: expiries.back()[2] = '-'; break;
+        }
+    }
+
+    const char* kernelName;
+    selectPaymentDigitMasks(&kernelName);
+    cout << "Validation benchmark: " << recordCount << " records, " << kernelName << " digit kernel" << endl;
+
+    vector<uint8_t> single(recordCount), batch(recordCount);
+    double singleTime = timeMilliseconds([&] {
+        for (size_t i = 0; i < recordCount; ++i) single[i] = PaymentValidator::check(phones[i], cards[i], ccvs[i], expiries[i]);
+    });
+    vector<PaymentFields> records(recordCount);
+    double fillTime = timeMilliseconds([&] {
+        for (size_t i = 0; i < recordCount; ++i) records[i] = PaymentFields::from(phones[i], cards[i], ccvs[i], expiries[i]);
+    });
+    double batchTime = timeMilliseconds([&] { PaymentValidator::checkBatch(records.data(), recordCount, batch.data()); });
+
+    size_t rejected = count_if(single.begin(), single.end(), [](uint8_t problems) { return problems != 0; });
+    cout << fixed << setprecision(0);
+    cout << "  one at a time: " << setw(11) << recordCount / (singleTime / 1000) << " records/s" << endl;
+    cout << "  batch:         " << setw(11) << recordCount / (batchTime / 1000) << " records/s ("
+         << recordCount / ((batchTime + fillTime) / 1000) << " including packing)" << endl;
+    cout << "  " << rejected << " records rejected; batch answers "
+         << (single == batch ? "match" : "DIFFER FROM") << " the one-at-a-time checks" << endl;
+}
+
 // Main entry point of the program
-int main() {
-    Application app;
+// Usage: program [catalog.bin]
+//        program --convert-catalog products.csv catalog.bin
+//        program --bench-search [product count]
+//        program --bench-auth [account count] [max threads]
+//        program --import-users accounts.csv
+//        program --bench-order-ids [ID count] [max threads]
+//        program --bench-journal [order count] [threads]
+//        program --bench-checkout [order count] [workers]
+//        program --bench-payments [order count] [max concurrent payments]
+//        program --bench-validate [record count]
+//        program --bench-idempotency [order count] [cache capacity]
+//        program --batch [script | -] [catalog.bin]
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && string(argv[1]) == "--bench-search") {
+        runSearchBenchmark(argc >= 3 ? stoul(argv[2]) : 1000000);
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--bench-auth") {
+        unsigned threads = argc >= 4 ? stoul(argv[3]) : max(1u, thread::hardware_concurrency());
+        runAuthBenchmark(argc >= 3 ? stoul(argv[2]) : 1000000, threads);
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--convert-catalog") {
+        if (argc != 4) {
+            cout << "Usage: " << argv[0] << " --convert-catalog products.csv catalog.bin" << endl;
+            return 1;
+        }
+        string errorMessage;
+        if (!convertCatalogCsv(argv[2], argv[3], &errorMessage)) {
+            cout << "Conversion failed: " << errorMessage << endl;
+            return 1;
+        }
+        cout << "Catalog written to " << argv[3] << endl;
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--bench-order-ids") {
+        unsigned threads = argc >= 4 ? stoul(argv[3]) : max(1u, thread::hardware_concurrency());
+        runOrderIdBenchmark(argc >= 3 ? stoul(argv[2]) : 10000000, threads);
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--bench-journal") {
+        runJournalBenchmark(argc >= 3 ? stoul(argv[2]) : 20000, argc >= 4 ? stoul(argv[3]) : 16);
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--bench-checkout") {
+        runCheckoutBenchmark(argc >= 3 ? stoul(argv[2]) : 20000, argc >= 4 ? stoul(argv[3]) : 16);
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--bench-payments") {
+        runPaymentBenchmark(argc >= 3 ? stoul(argv[2]) : 4000, argc >= 4 ? stoul(argv[3]) : 256);
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--bench-validate") {
+        runValidationBenchmark(argc >= 3 ? stoul(argv[2]) : 1000000);
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--bench-idempotency") {
+        runIdempotencyBenchmark(argc >= 3 ? stoul(argv[2]) : 50000, argc >= 4 ? stoul(argv[3]) : 4096);
+        return 0;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--import-users") {
+        if (argc != 3) {
+            cout << "Usage: " << argv[0] << " --import-users accounts.csv" << endl;
+            return 1;
+        }
+        Application app; // the store in the current folder; its snapshot is saved on the way out
+        ImportSummary summary;
+        string errorMessage;
+        bool imported = false;
+        double elapsed = timeMilliseconds([&] {
+            imported = app.importUsers(argv[2], max(1u, thread::hardware_concurrency()), cout, &summary, &errorMessage);
+        });
+        if (!imported) {
+            cout << "Import failed: " << errorMessage << endl;
+            return 1;
+        }
+        cout << "Imported " << summary.imported << " of " << summary.rows << " rows (" << summary.rejected
+             << " rejected) in " << fixed << setprecision(0) << elapsed << " ms, "
+             << summary.rows / max(elapsed / 1000, 1e-9) << " rows/s" << endl;
+        return summary.rejected == 0 ? 0 : 2;
+    }
+
+    if (argc >= 2 && string(argv[1]) == "--batch") {
+        string script;
+        MappedFile file;
+        string errorMessage;
+        if (argc < 3 || string(argv[2]) == "-") {
+            ostringstream input;
+            input << cin.rdbuf();
+            script = input.str();
+        } else if (!file.open(argv[2], &errorMessage)) {
+            cout << "Could not read " << argv[2] << ": " << errorMessage << endl;
+            return 1;
+        }
+        Application app(argc >= 4 ? argv[3] : "catalog.bin");
+        BatchRunner runner(app, cout);
+        double elapsed = timeMilliseconds([&] {
+            runner.run(file.size() ? string_view(file.bytes(), file.size()) : string_view(script));
+        });
+        runner.printSummary(elapsed);
+        return runner.anyFailed() ? 2 : 0;
+    }
+
+    Application app(argc >= 2 ? argv[1] : "catalog.bin");
     app.run();
     return 0;
 }
\ No newline at end of file